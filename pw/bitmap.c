@@ -26,103 +26,549 @@
  * SUCH DAMAGE.
  */
 
+#include <err.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "bitmap.h"
 
+#define BM_CHUNKBITS	16
+#define BM_CHUNKSIZE	(1 << BM_CHUNKBITS)
+#define BM_CHUNKMASK	(BM_CHUNKSIZE - 1)
+#define BM_WORDS	(BM_CHUNKSIZE / 64)	/* 1024 leaf words */
+#define BM_SUMWORDS	(BM_WORDS / 64)		/* 16 summary words */
+#define BM_SUMMASK	((1ULL << BM_SUMWORDS) - 1)
+#define BM_ARRAYMAX	4096			/* array chunks up to 8KB */
+
+/*
+ * Dense chunk: one bit per id, plus two summary levels with a bit per
+ * word below it telling whether that word is full (for first-unset) or
+ * has any bit set (for last-set).  Searches are three ctz/clz steps.
+ */
+struct bm_dense
+{
+	uint64_t	map[BM_WORDS];
+	uint64_t	full[BM_SUMWORDS];
+	uint64_t	any[BM_SUMWORDS];
+	uint64_t	fulltop;
+	uint64_t	anytop;
+};
+
+static void *
+bm_realloc(void *p, size_t nmemb, size_t size)
+{
+	if ((p = reallocarray(p, nmemb, size)) == NULL)
+		err(1, "reallocarray()");
+	return p;
+}
+
+static void
+bm_putbit(uint64_t *w, unsigned i, int on)
+{
+	if (on)
+		*w |= 1ULL << i;
+	else
+		*w &= ~(1ULL << i);
+}
+
+/*
+ * Recompute the summary bits covering leaf words lo..hi.
+ */
+static void
+bm_dense_fixup(struct bm_dense *d, unsigned lo, unsigned hi)
+{
+	unsigned i;
+
+	for (i = lo; i <= hi; i++) {
+		bm_putbit(&d->full[i / 64], i % 64, d->map[i] == ~0ULL);
+		bm_putbit(&d->any[i / 64], i % 64, d->map[i] != 0);
+	}
+	for (i = lo / 64; i <= hi / 64; i++) {
+		bm_putbit(&d->fulltop, i, d->full[i] == ~0ULL);
+		bm_putbit(&d->anytop, i, d->any[i] != 0);
+	}
+}
+
+/*
+ * Set or clear bits lo..hi of a dense chunk; returns how many bits
+ * actually changed.
+ */
+static unsigned
+bm_dense_range(struct bm_dense *d, unsigned lo, unsigned hi, int on)
+{
+	unsigned i, wlo, whi, n;
+	uint64_t m, old;
+
+	wlo = lo / 64;
+	whi = hi / 64;
+	for (n = 0, i = wlo; i <= whi; i++) {
+		m = ~0ULL;
+		if (i == wlo)
+			m &= ~0ULL << (lo % 64);
+		if (i == whi)
+			m &= ~0ULL >> (63 - hi % 64);
+		old = d->map[i];
+		d->map[i] = on ? old | m : old & ~m;
+		n += __builtin_popcountll(old ^ d->map[i]);
+	}
+	bm_dense_fixup(d, wlo, whi);
+	return n;
+}
+
+static unsigned
+bm_dense_firstunset(const struct bm_dense *d)
+{
+	unsigned i, w;
+
+	i = __builtin_ctzll(~d->fulltop & BM_SUMMASK);
+	w = i * 64 + __builtin_ctzll(~d->full[i]);
+	return w * 64 + __builtin_ctzll(~d->map[w]);
+}
+
+static unsigned
+bm_dense_lastset(const struct bm_dense *d)
+{
+	unsigned i, w;
+
+	i = 63 - __builtin_clzll(d->anytop);
+	w = i * 64 + (63 - __builtin_clzll(d->any[i]));
+	return w * 64 + (63 - __builtin_clzll(d->map[w]));
+}
+
+static int
+bm_isfull(const struct bm_chunk *c)
+{
+	return c->card == BM_CHUNKSIZE;
+}
+
+/*
+ * Index of the first array slot >= low.
+ */
+static uint32_t
+bm_arr_find(const struct bm_chunk *c, unsigned low)
+{
+	uint32_t lo = 0, hi = c->card, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (c->arr[mid] < low)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Turn an array or full chunk into a dense one.
+ */
+static void
+bm_densify(struct bm_chunk *c)
+{
+	struct bm_dense *d;
+	uint32_t i;
+
+	if ((d = calloc(1, sizeof(*d))) == NULL)
+		err(1, "calloc()");
+	if (bm_isfull(c))
+		bm_dense_range(d, 0, BM_CHUNKMASK, 1);
+	else {
+		for (i = 0; i < c->card; i++)
+			d->map[c->arr[i] / 64] |= 1ULL << (c->arr[i] % 64);
+		bm_dense_fixup(d, 0, BM_WORDS - 1);
+	}
+	free(c->arr);
+	c->arr = NULL;
+	c->acap = 0;
+	c->dense = d;
+}
+
+static void
+bm_chunk_free(struct bm_chunk *c)
+{
+	free(c->arr);
+	free(c->dense);
+	c->arr = NULL;
+	c->dense = NULL;
+	c->card = c->acap = 0;
+}
+
+/*
+ * Index of the first chunk with a key >= key.
+ */
+static size_t
+bm_find(const struct bitmap *bm, uint32_t key)
+{
+	size_t lo = 0, hi = bm->nchunks, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (bm->chunks[mid].key < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static struct bm_chunk *
+bm_lookup(const struct bitmap *bm, uint32_t key)
+{
+	size_t i = bm_find(bm, key);
+
+	if (i < bm->nchunks && bm->chunks[i].key == key)
+		return &bm->chunks[i];
+	return NULL;
+}
+
+static struct bm_chunk *
+bm_getchunk(struct bitmap *bm, uint32_t key)
+{
+	size_t i = bm_find(bm, key);
+
+	if (i < bm->nchunks && bm->chunks[i].key == key)
+		return &bm->chunks[i];
+	if (bm->nchunks == bm->cap) {
+		bm->cap = bm->cap ? bm->cap * 2 : 8;
+		bm->chunks = bm_realloc(bm->chunks, bm->cap,
+		    sizeof(*bm->chunks));
+	}
+	memmove(&bm->chunks[i + 1], &bm->chunks[i],
+	    (bm->nchunks - i) * sizeof(*bm->chunks));
+	bm->nchunks++;
+	memset(&bm->chunks[i], 0, sizeof(bm->chunks[i]));
+	bm->chunks[i].key = key;
+	return &bm->chunks[i];
+}
+
+static void
+bm_dropchunk(struct bitmap *bm, struct bm_chunk *c)
+{
+	size_t i = c - bm->chunks;
+
+	bm_chunk_free(c);
+	memmove(&bm->chunks[i], &bm->chunks[i + 1],
+	    (bm->nchunks - i - 1) * sizeof(*bm->chunks));
+	bm->nchunks--;
+}
+
+/*
+ * Set or clear bits lo..hi (low 16 bits) of one chunk.
+ */
+static void
+bm_chunk_range(struct bitmap *bm, uint32_t key, unsigned lo, unsigned hi,
+    int on)
+{
+	struct bm_chunk *c;
+	uint32_t a, b, i;
+	unsigned n = hi - lo + 1;
+
+	if (!on && (c = bm_lookup(bm, key)) == NULL)
+		return;
+	if (on)
+		c = bm_getchunk(bm, key);
+	if (n == BM_CHUNKSIZE) {
+		if (!on) {
+			bm_dropchunk(bm, c);
+			return;
+		}
+		bm_chunk_free(c);
+		c->card = BM_CHUNKSIZE;
+		return;
+	}
+	if (on && bm_isfull(c))
+		return;
+	if (c->dense == NULL && (bm_isfull(c) ||
+	    (on && c->card + n > BM_ARRAYMAX)))
+		bm_densify(c);
+
+	if (c->dense != NULL) {
+		if (on)
+			c->card += bm_dense_range(c->dense, lo, hi, 1);
+		else
+			c->card -= bm_dense_range(c->dense, lo, hi, 0);
+		if (bm_isfull(c)) {
+			free(c->dense);
+			c->dense = NULL;
+		}
+	} else if (on) {
+		for (i = lo; i <= hi; i++) {
+			a = bm_arr_find(c, i);
+			if (a < c->card && c->arr[a] == i)
+				continue;
+			if (c->card == c->acap) {
+				c->acap = c->acap ? c->acap * 2 : 4;
+				c->arr = bm_realloc(c->arr, c->acap,
+				    sizeof(*c->arr));
+			}
+			memmove(&c->arr[a + 1], &c->arr[a],
+			    (c->card - a) * sizeof(*c->arr));
+			c->arr[a] = i;
+			c->card++;
+		}
+	} else {
+		a = bm_arr_find(c, lo);
+		b = bm_arr_find(c, hi + 1);
+		memmove(&c->arr[a], &c->arr[b],
+		    (c->card - b) * sizeof(*c->arr));
+		c->card -= b - a;
+	}
+	if (c->card == 0)
+		bm_dropchunk(bm, c);
+}
+
+static void
+bm_range(struct bitmap *bm, int64_t from, int64_t to, int on)
+{
+	int64_t k, klo, khi;
+
+	if (from < 0)
+		from = 0;
+	if (to >= bm->size)
+		to = bm->size - 1;
+	if (from > to)
+		return;
+	klo = from >> BM_CHUNKBITS;
+	khi = to >> BM_CHUNKBITS;
+	for (k = klo; k <= khi; k++)
+		bm_chunk_range(bm, (uint32_t)k,
+		    k == klo ? (unsigned)(from & BM_CHUNKMASK) : 0,
+		    k == khi ? (unsigned)(to & BM_CHUNKMASK) : BM_CHUNKMASK,
+		    on);
+}
+
 struct bitmap
-bm_alloc(int size)
+bm_alloc(int64_t size)
 {
 	struct bitmap   bm;
-	int             szmap = (size / 8) + !!(size % 8);
 
+	memset(&bm, 0, sizeof(bm));
 	bm.size = size;
-	bm.map = malloc(szmap);
-	if (bm.map)
-		memset(bm.map, 0, szmap);
 	return bm;
 }
 
 void
 bm_dealloc(struct bitmap * bm)
 {
-	free(bm->map);
+	size_t          i;
+
+	for (i = 0; i < bm->nchunks; i++)
+		bm_chunk_free(&bm->chunks[i]);
+	free(bm->chunks);
+	bm->chunks = NULL;
+	bm->nchunks = bm->cap = 0;
 }
 
-static void
-bm_getmask(int *pos, unsigned char *bmask)
+struct bitmap
+bm_dup(const struct bitmap * bm)
 {
-	*bmask = (unsigned char) (1 << (*pos % 8));
-	*pos /= 8;
+	struct bitmap   nbm;
+	struct bm_chunk *c;
+	size_t          i;
+
+	nbm = bm_alloc(bm->size);
+	if (bm->nchunks == 0)
+		return nbm;
+	nbm.chunks = bm_realloc(NULL, bm->nchunks, sizeof(*nbm.chunks));
+	nbm.nchunks = nbm.cap = bm->nchunks;
+	for (i = 0; i < bm->nchunks; i++) {
+		c = &nbm.chunks[i];
+		*c = bm->chunks[i];
+		if (c->arr != NULL) {
+			c->arr = bm_realloc(NULL, c->acap, sizeof(*c->arr));
+			memcpy(c->arr, bm->chunks[i].arr,
+			    c->card * sizeof(*c->arr));
+		}
+		if (c->dense != NULL) {
+			if ((c->dense = malloc(sizeof(*c->dense))) == NULL)
+				err(1, "malloc()");
+			memcpy(c->dense, bm->chunks[i].dense,
+			    sizeof(*c->dense));
+		}
+	}
+	return nbm;
 }
 
 void
-bm_setbit(struct bitmap * bm, int pos)
+bm_setbit(struct bitmap * bm, int64_t pos)
 {
-	unsigned char   bmask;
+	bm_range(bm, pos, pos, 1);
+}
 
-	bm_getmask(&pos, &bmask);
-	bm->map[pos] |= bmask;
+void
+bm_clrbit(struct bitmap * bm, int64_t pos)
+{
+	bm_range(bm, pos, pos, 0);
 }
 
 void
-bm_clrbit(struct bitmap * bm, int pos)
+bm_setrange(struct bitmap * bm, int64_t from, int64_t to)
 {
-	unsigned char   bmask;
+	bm_range(bm, from, to, 1);
+}
 
-	bm_getmask(&pos, &bmask);
-	bm->map[pos] &= ~bmask;
+void
+bm_clrrange(struct bitmap * bm, int64_t from, int64_t to)
+{
+	bm_range(bm, from, to, 0);
 }
 
 int
-bm_isset(struct bitmap * bm, int pos)
+bm_isset(struct bitmap * bm, int64_t pos)
 {
-	unsigned char   bmask;
+	struct bm_chunk *c;
+	unsigned        low;
+	uint32_t        a;
 
-	bm_getmask(&pos, &bmask);
-	return !!(bm->map[pos] & bmask);
+	if (pos < 0 || pos >= bm->size ||
+	    (c = bm_lookup(bm, (uint32_t)(pos >> BM_CHUNKBITS))) == NULL)
+		return 0;
+	low = pos & BM_CHUNKMASK;
+	if (bm_isfull(c))
+		return 1;
+	if (c->dense != NULL)
+		return !!(c->dense->map[low / 64] & (1ULL << (low % 64)));
+	a = bm_arr_find(c, low);
+	return a < c->card && c->arr[a] == low;
 }
 
-int
+/*
+ * Returns bm->size if every bit is set.
+ */
+int64_t
 bm_firstunset(struct bitmap * bm)
 {
-	int             szmap = (bm->size / 8) + !!(bm->size % 8);
-	int             at = 0;
-	int             pos = 0;
+	const struct bm_chunk *c;
+	int64_t         pos;
+	uint32_t        key, i;
+	size_t          n;
 
-	while (pos < szmap) {
-		unsigned char   bmv = bm->map[pos++];
-		unsigned char   bmask = 1;
-
-		while (bmask & 0xff) {
-			if ((bmv & bmask) == 0)
-				return at;
-			bmask <<= 1;
-			++at;
-		}
+	pos = bm->size;
+	for (key = 0, n = 0; n < bm->nchunks; n++, key++) {
+		c = &bm->chunks[n];
+		if (c->key != key)
+			break;
+		if (bm_isfull(c))
+			continue;
+		if (c->dense != NULL)
+			i = bm_dense_firstunset(c->dense);
+		else
+			for (i = 0; i < c->card && c->arr[i] == i; i++)
+				;
+		pos = ((int64_t)key << BM_CHUNKBITS) | i;
+		return pos < bm->size ? pos : bm->size;
 	}
-	return at;
+	pos = (int64_t)key << BM_CHUNKBITS;
+	return pos < bm->size ? pos : bm->size;
 }
 
-int
+/*
+ * Returns 0 if no bit is set, as it always has.
+ */
+int64_t
 bm_lastset(struct bitmap * bm)
 {
-	int             szmap = (bm->size / 8) + !!(bm->size % 8);
-	int             at = 0;
-	int             pos = 0;
-	int             ofs = 0;
+	const struct bm_chunk *c;
+	unsigned        low;
 
-	while (pos < szmap) {
-		unsigned char   bmv = bm->map[pos++];
-		unsigned char   bmask = 1;
+	if (bm->nchunks == 0)
+		return 0;
+	c = &bm->chunks[bm->nchunks - 1];
+	if (bm_isfull(c))
+		low = BM_CHUNKMASK;
+	else if (c->dense != NULL)
+		low = bm_dense_lastset(c->dense);
+	else
+		low = c->arr[c->card - 1];
+	return ((int64_t)c->key << BM_CHUNKBITS) | low;
+}
+
+/*
+ * First set bit at or after pos; bm->size if there is none.
+ */
+int64_t
+bm_nextset(struct bitmap * bm, int64_t pos)
+{
+	const struct bm_chunk *c;
+	unsigned        low, w;
+	uint64_t        m;
+	uint32_t        a;
+	size_t          n;
 
-		while (bmask & 0xff) {
-			if ((bmv & bmask) != 0)
-				ofs = at;
-			bmask <<= 1;
-			++at;
+	if (pos < 0)
+		pos = 0;
+	if (pos >= bm->size)
+		return bm->size;
+	n = bm_find(bm, (uint32_t)(pos >> BM_CHUNKBITS));
+	for (; n < bm->nchunks; n++) {
+		c = &bm->chunks[n];
+		if (c->key > (uint32_t)(pos >> BM_CHUNKBITS))
+			pos = (int64_t)c->key << BM_CHUNKBITS;
+		low = pos & BM_CHUNKMASK;
+		if (bm_isfull(c))
+			break;
+		if (c->dense != NULL) {
+			w = low / 64;
+			m = c->dense->map[w] & (~0ULL << (low % 64));
+			while (m == 0 && ++w < BM_WORDS)
+				m = c->dense->map[w];
+			if (m == 0)
+				continue;
+			low = w * 64 + __builtin_ctzll(m);
+		} else if ((a = bm_arr_find(c, low)) < c->card)
+			low = c->arr[a];
+		else
+			continue;
+		pos = ((int64_t)c->key << BM_CHUNKBITS) | low;
+		break;
+	}
+	if (n == bm->nchunks || pos > bm->size)
+		pos = bm->size;
+	return pos;
+}
+
+/*
+ * First unset bit at or after pos; bm->size if there is none.
+ */
+int64_t
+bm_nextunset(struct bitmap * bm, int64_t pos)
+{
+	const struct bm_chunk *c;
+	unsigned        low, w;
+	uint64_t        m;
+	uint32_t        a;
+
+	if (pos < 0)
+		pos = 0;
+	while (pos < bm->size) {
+		if ((c = bm_lookup(bm, (uint32_t)(pos >> BM_CHUNKBITS))) == NULL)
+			return pos;
+		low = pos & BM_CHUNKMASK;
+		if (bm_isfull(c)) {
+			pos = ((int64_t)c->key + 1) << BM_CHUNKBITS;
+			continue;
+		}
+		if (c->dense != NULL) {
+			w = low / 64;
+			m = ~c->dense->map[w] & (~0ULL << (low % 64));
+			while (m == 0 && ++w < BM_WORDS)
+				m = ~c->dense->map[w];
+			if (m == 0) {
+				pos = ((int64_t)c->key + 1) << BM_CHUNKBITS;
+				continue;
+			}
+			low = w * 64 + __builtin_ctzll(m);
+		} else {
+			for (a = bm_arr_find(c, low);
+			    a < c->card && c->arr[a] == low; a++)
+				low++;
+			if (low > BM_CHUNKMASK) {
+				pos = ((int64_t)c->key + 1) << BM_CHUNKBITS;
+				continue;
+			}
 		}
+		pos = ((int64_t)c->key << BM_CHUNKBITS) | low;
+		break;
 	}
-	return ofs;
+	return pos < bm->size ? pos : bm->size;
 }
@@ -30,21 +30,48 @@
 #define _BITMAP_H_
 
 #include <sys/cdefs.h>
+#include <stdint.h>
+
+/*
+ * A set of ids, stored sparsely so that memory and time depend on the
+ * number of ids set rather than on the width of the range.  The id
+ * space is cut into chunks of 2^16; only chunks holding at least one id
+ * exist, kept sorted by their upper bits.  A chunk is either a sorted
+ * array of the lower 16 bits (while small), a dense 64-bit word bitmap
+ * with full/any summary words on top, or marked completely full.
+ */
+struct bm_dense;
+
+struct bm_chunk
+{
+	uint32_t	key;		/* pos >> 16 */
+	uint32_t	card;		/* number of bits set */
+	uint32_t	acap;		/* allocated slots in arr */
+	uint16_t	*arr;		/* sorted low bits, if an array chunk */
+	struct bm_dense	*dense;		/* bitmap, if a dense chunk */
+};
 
 struct bitmap
 {
-	int	      size;
-	unsigned char *map;
+	int64_t		size;
+	size_t		nchunks;
+	size_t		cap;
+	struct bm_chunk	*chunks;
 };
 
 __BEGIN_DECLS
-struct bitmap bm_alloc(int size);
+struct bitmap bm_alloc(int64_t size);
 void bm_dealloc(struct bitmap * bm);
-void bm_setbit(struct bitmap * bm, int pos);
-void bm_clrbit(struct bitmap * bm, int pos);
-int bm_isset(struct bitmap * bm, int pos);
-int bm_firstunset(struct bitmap * bm);
-int bm_lastset(struct bitmap * bm);
+struct bitmap bm_dup(const struct bitmap * bm);
+void bm_setbit(struct bitmap * bm, int64_t pos);
+void bm_clrbit(struct bitmap * bm, int64_t pos);
+void bm_setrange(struct bitmap * bm, int64_t from, int64_t to);
+void bm_clrrange(struct bitmap * bm, int64_t from, int64_t to);
+int bm_isset(struct bitmap * bm, int64_t pos);
+int64_t bm_firstunset(struct bitmap * bm);
+int64_t bm_lastset(struct bitmap * bm);
+int64_t bm_nextset(struct bitmap * bm, int64_t pos);
+int64_t bm_nextunset(struct bitmap * bm, int64_t pos);
 __END_DECLS
 
 #endif				/* !_BITMAP_H */
@@ -0,0 +1,141 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (C) 1996
+ *	David L. Nugent.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DAVID L. NUGENT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL DAVID L. NUGENT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmark of the id bitmap over the whole 2^32 uid_t range, in
+ * the ways pw_uidused() and pw_uidtake() use it: build a set from a
+ * file's worth of ids, then look for the first unused and the last used
+ * id.  Not part of pw; built by "make bitmap-bench".
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bitmap.h"
+
+#define RANGE		(INT64_C(1) << 32)
+
+static uint64_t seed = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t
+rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return (seed);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime()");
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void
+report(const char *what, long n, double t)
+{
+	printf("%-36s %10ld %10.3f ms %10.1f ns/op\n", what, n, t * 1e3,
+	    n > 0 ? t * 1e9 / n : 0.0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bitmap bm;
+	int64_t pos, sum;
+	long i, nset, nsearch;
+	double t;
+
+	nset = argc > 1 ? strtol(argv[1], NULL, 0) : 100000;
+	nsearch = argc > 2 ? strtol(argv[2], NULL, 0) : 1000000;
+	sum = 0;
+
+	t = now();
+	bm = bm_alloc(RANGE);
+	report("bm_alloc(2^32)", 1, now() - t);
+
+	/* Ids scattered over the whole range, as on a large site */
+	t = now();
+	for (i = 0; i < nset; i++)
+		bm_setbit(&bm, (int64_t)(rnd() % RANGE));
+	report("bm_setbit, random", nset, now() - t);
+
+	/* A dense run from the bottom, as allocated by policy */
+	t = now();
+	for (i = 0; i < nset; i++)
+		bm_setbit(&bm, i);
+	report("bm_setbit, sequential", nset, now() - t);
+
+	t = now();
+	for (i = 0; i < nsearch; i++)
+		sum += bm_firstunset(&bm);
+	report("bm_firstunset", nsearch, now() - t);
+
+	t = now();
+	for (i = 0; i < nsearch; i++)
+		sum += bm_lastset(&bm);
+	report("bm_lastset", nsearch, now() - t);
+
+	t = now();
+	for (i = 0; i < nsearch; i++)
+		sum += bm_isset(&bm, (int64_t)(rnd() % RANGE));
+	report("bm_isset, random", nsearch, now() - t);
+
+	t = now();
+	for (i = 0, pos = 0; i < nsearch && pos < RANGE; i++)
+		pos = bm_nextset(&bm, pos) + 1;
+	report("bm_nextset, walk", i, now() - t);
+
+	/* Fill and empty the top half, then allocate past the hole */
+	t = now();
+	bm_setrange(&bm, RANGE / 2, RANGE - 1);
+	report("bm_setrange, 2^31 bits", 1, now() - t);
+	t = now();
+	sum += bm_nextunset(&bm, RANGE / 2);
+	report("bm_nextunset over 2^31 set bits", 1, now() - t);
+	t = now();
+	bm_clrrange(&bm, RANGE / 2, RANGE - 1);
+	report("bm_clrrange, 2^31 bits", 1, now() - t);
+
+	t = now();
+	bm_dealloc(&bm);
+	report("bm_dealloc", 1, now() - t);
+
+	/* Keep the searches from being optimized away */
+	if (sum == 42)
+		printf("\n");
+	return (0);
+}
@@ -27,13 +27,16 @@
  */
 
 #include <err.h>
+#include <errno.h>
 #include <grp.h>
 #include <libutil.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "pwupd.h"
+#include "idstate.h"
 
 char *
 getgrpath(const char * file)
@@ -45,63 +48,192 @@ getgrpath(const char * file)
 	return (pathbuf);
 }
 
+/*
+ * Rewrite the group file from ifd, or from itself if ifd is -1, with a
+ * set of changes applied.
+ */
 static int
-gr_update(struct group * grp, char const * group)
+gr_update(int ifd, struct pwtxent *ent, size_t n)
 {
-	int pfd, tfd;
-	struct group *gr = NULL;
-	struct group *old_gr = NULL;
-
-	if (grp != NULL)
-		gr = gr_dup(grp);
-
-	if (group != NULL)
-		old_gr = vgetgrnam(group);
+	struct pwtxent	*e;
+	struct group	*gr;
+	struct stat	 st;
+	size_t		 i, nids;
+	uintmax_t	*ids;
+	bool		 freed;
+	int		 rc, pfd, tfd;
 
 	if (gr_init(conf.etcpath, NULL))
 		err(1, "gr_init()");
-
-	if ((pfd = gr_lock()) == -1) {
+	if (conf.lockwait > 0)
+		pfd = pw_lockwait(getgrpath(_GROUP));
+	else if ((pfd = gr_lock()) == -1) {
 		gr_fini();
 		err(1, "gr_lock()");
 	}
+	if (fstat(pfd, &st) == -1) {
+		gr_fini();
+		err(1, "fstat()");
+	}
 	if ((tfd = gr_tmp(-1)) == -1) {
 		gr_fini();
 		err(1, "gr_tmp()");
 	}
-	if (gr_copy(pfd, tfd, gr, old_gr) == -1) {
-		gr_fini();
+	if ((rc = pw_txrewrite(PWTX_GR, ifd != -1 ? ifd : pfd, tfd, ent, n,
+	    NULL)) != 0) {
 		close(tfd);
-		err(1, "gr_copy()");
+		gr_fini();
+		pw_unlockwait();
+		errno = rc;
+		return (-1);
+	}
+	if (ifd == -1 && pw_txfolding(PWTX_GR, tfd) == -1) {
+		gr_fini();
+		err(1, "%s", getpwpath(_PWJOURNAL));
 	}
-	fsync(tfd);
 	close(tfd);
+
+	if ((ids = calloc(n ? n : 1, sizeof(*ids))) == NULL)
+		err(1, "calloc()");
+	nids = 0;
+	freed = ifd != -1;
+	for (i = 0; i < n; i++) {
+		e = &ent[i];
+		if ((gr = e->rec) == NULL) {
+			freed |= e->key != NULL;
+			continue;
+		}
+		if (e->key != NULL && e->oid != gr->gr_gid)
+			freed = true;
+		ids[nids++] = gr->gr_gid;
+	}
 	if (gr_mkdb() == -1) {
 		gr_fini();
 		err(1, "gr_mkdb()");
 	}
-	free(old_gr);
-	free(gr);
+	if (PWALTDIR() != PWF_REGULAR)
+		vgridxupdate();
+	ids_commit(IDS_GID, &st, ids, nids, freed);
 	gr_fini();
-	return 0;
+	pw_unlockwait();
+	free(ids);
+	return (0);
+}
+
+/*
+ * Apply a set of pending changes to the group file in one pass, as
+ * pw_commit() does for master.passwd.
+ */
+int
+gr_commit(struct pwtxent *ent, size_t n)
+{
+	return (gr_update(-1, ent, n));
+}
+
+/*
+ * Put back the group file as it was before gr_commit(), from ofd, open
+ * on the file it replaced.
+ */
+int
+gr_restore(int ofd)
+{
+	return (gr_update(ofd, NULL, 0));
 }
 
 
 int
 addgrent(struct group * grp)
 {
-	return gr_update(grp, NULL);
+	return (pw_txadd(PWTX_GR, grp));
 }
 
 int
 chggrent(char const * login, struct group * grp)
 {
-	return gr_update(grp, login);
+	return (pw_txchg(PWTX_GR, login, grp));
 }
 
 int
 delgrent(struct group * grp)
 {
 
-	return (gr_update(NULL, grp->gr_name));
+	return (pw_txdel(PWTX_GR, grp->gr_name));
+}
+
+/*
+ * Change one user's membership of every group with a single walk of
+ * the group file.  name is the user's current name and newname the one
+ * to list it under, or NULL to remove it from every group.  The user
+ * ends up a member of each group in groups; with replace it is removed
+ * from all others, otherwise its other memberships are kept.
+ */
+void
+chggrmembers(const char *name, const char *newname, StringList *groups,
+    bool replace)
+{
+	struct group	*grp, ngrp, **chg;
+	char		**mem;
+	size_t		 nchg, chgcap, i;
+	int		 j, k;
+	bool		 was, has, want, placed;
+
+	chg = NULL;
+	nchg = chgcap = 0;
+	SETGRENT();
+	while ((grp = GETGRENT()) != NULL) {
+		was = has = false;
+		for (j = 0; grp->gr_mem != NULL && grp->gr_mem[j] != NULL; j++)
+			if (strcmp(grp->gr_mem[j], name) == 0)
+				was = true;
+			else if (newname != NULL &&
+			    strcmp(grp->gr_mem[j], newname) == 0)
+				has = true;
+		want = newname != NULL && ((groups != NULL &&
+		    sl_find(groups, grp->gr_name) != NULL) ||
+		    ((was || has) && !replace));
+		if (!(was && (!want || strcmp(name, newname) != 0)) &&
+		    !(has && !want) && !(want && !was && !has))
+			continue;
+
+		/*
+		 * Gather the new lists first: the lookups made by chggrent()
+		 * would disturb the walk
+		 */
+		if ((mem = calloc(j + 2, sizeof(*mem))) == NULL)
+			err(1, "calloc()");
+		placed = false;
+		for (j = k = 0; grp->gr_mem != NULL && grp->gr_mem[j] != NULL;
+		    j++) {
+			if (strcmp(grp->gr_mem[j], name) != 0 &&
+			    (newname == NULL ||
+			    strcmp(grp->gr_mem[j], newname) != 0))
+				mem[k++] = grp->gr_mem[j];
+			else if (want && !placed) {
+				mem[k++] = (char *)newname;
+				placed = true;
+			}
+		}
+		if (want && !placed)
+			mem[k++] = (char *)newname;
+		mem[k] = NULL;
+		ngrp = *grp;
+		ngrp.gr_mem = mem;
+		if (nchg == chgcap) {
+			chgcap = chgcap ? chgcap * 2 : 16;
+			if ((chg = reallocarray(chg, chgcap,
+			    sizeof(*chg))) == NULL)
+				err(1, "reallocarray()");
+		}
+		if ((chg[nchg++] = gr_dup(&ngrp)) == NULL)
+			err(1, "gr_dup()");
+		free(mem);
+	}
+	ENDGRENT();
+
+	for (i = 0; i < nchg; i++) {
+		chggrent(chg[i]->gr_name, chg[i]);
+		free(chg[i]);
+	}
+	free(chg);
 }
+
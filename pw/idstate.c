@@ -0,0 +1,538 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (C) 1996
+ *	David L. Nugent.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DAVID L. NUGENT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL DAVID L. NUGENT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/param.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pwupd.h"
+#include "idstate.h"
+
+/*
+ * The file is plain text, one header line per kind followed by its
+ * free ranges, then any reservations:
+ *
+ *	uid <min> <max> <dev> <ino> <size> <sec> <nsec> <hwm> <nfree>
+ *	<lo> <hi>
+ *	...
+ *	rsv uid <lo> <hi> <expires>
+ *
+ * hwm is -1 when no id in the range is in use.  Anything that does not
+ * parse is treated as missing state, so the worst a damaged file can
+ * do is cost one rescan.  The file is rewritten in place under flock(2)
+ * so that every read-modify-write is serialised.
+ */
+struct ids_gen
+{
+	uintmax_t	dev, ino, size;
+	intmax_t	sec, nsec;
+};
+
+struct ids_sect
+{
+	bool		present;
+	uintmax_t	min, max;
+	struct ids_gen	gen;
+	intmax_t	hwm;
+	size_t		nfree;
+	uintmax_t	*free;		/* lo, hi pairs */
+};
+
+struct ids_rsv
+{
+	int		kind;
+	uintmax_t	lo, hi;
+	intmax_t	expires;
+};
+
+struct ids_file
+{
+	struct ids_sect	sect[IDS_NKINDS];
+	size_t		nrsv, rsvcap;
+	struct ids_rsv	*rsv;
+};
+
+static const char *ids_names[IDS_NKINDS] = { "uid", "gid" };
+
+/* Generation seen by the last ids_load(), stamped by ids_save() */
+static struct ids_gen ids_seen[IDS_NKINDS];
+static bool ids_seenok[IDS_NKINDS];
+
+/* Descriptor held between ids_lock() and ids_unlock() */
+static int ids_fd = -1;
+
+static void
+ids_getgen(struct ids_gen *gen, const struct stat *st)
+{
+	gen->dev = st->st_dev;
+	gen->ino = st->st_ino;
+	gen->size = st->st_size;
+	gen->sec = st->st_mtim.tv_sec;
+	gen->nsec = st->st_mtim.tv_nsec;
+}
+
+/*
+ * Current generation of the database a kind is derived from.
+ */
+static bool
+ids_dbgen(enum ids_kind kind, struct ids_gen *gen)
+{
+	struct stat st;
+	const char *db;
+
+	db = kind == IDS_UID ? getpwpath(_MASTERPASSWD) : getgrpath(_GROUP);
+	if (stat(db, &st) == -1)
+		return (false);
+	ids_getgen(gen, &st);
+	return (true);
+}
+
+static bool
+ids_samegen(const struct ids_gen *a, const struct ids_gen *b)
+{
+	return (a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+	    a->sec == b->sec && a->nsec == b->nsec);
+}
+
+static bool
+ids_sane(const struct ids_sect *s)
+{
+	return (s->present && s->min <= s->max && (s->hwm < 0 ||
+	    ((uintmax_t)s->hwm >= s->min && (uintmax_t)s->hwm <= s->max)));
+}
+
+static void
+ids_dropsect(struct ids_sect *s)
+{
+	free(s->free);
+	memset(s, 0, sizeof(*s));
+}
+
+static void
+ids_free(struct ids_file *f)
+{
+	int i;
+
+	for (i = 0; i < IDS_NKINDS; i++)
+		ids_dropsect(&f->sect[i]);
+	free(f->rsv);
+	memset(f, 0, sizeof(*f));
+}
+
+static void
+ids_addrsv(struct ids_file *f, int kind, uintmax_t lo, uintmax_t hi,
+    intmax_t expires)
+{
+	struct ids_rsv *r;
+
+	if (f->nrsv > 0) {
+		r = &f->rsv[f->nrsv - 1];
+		if (r->kind == kind && r->expires == expires && r->hi + 1 == lo) {
+			r->hi = hi;
+			return;
+		}
+	}
+	if (f->nrsv == f->rsvcap) {
+		f->rsvcap = f->rsvcap ? f->rsvcap * 2 : 16;
+		if ((f->rsv = reallocarray(f->rsv, f->rsvcap,
+		    sizeof(*f->rsv))) == NULL)
+			err(1, "reallocarray()");
+	}
+	r = &f->rsv[f->nrsv++];
+	r->kind = kind;
+	r->lo = lo;
+	r->hi = hi;
+	r->expires = expires;
+}
+
+/*
+ * Open and flock(2) the state file, or reuse the descriptor held by
+ * ids_lock().  Returns -1 if there is no file (and create is false) or
+ * it cannot be opened.
+ */
+static int
+ids_open(bool excl, bool create)
+{
+	int fd, flags;
+
+	if (ids_fd != -1)
+		return (ids_fd);
+	flags = excl ? O_RDWR : O_RDONLY;
+	if (create)
+		flags |= O_CREAT;
+	if ((fd = open(getpwpath(_IDSTATE), flags | O_CLOEXEC, 0644)) == -1)
+		return (-1);
+	if (flock(fd, excl ? LOCK_EX : LOCK_SH) == -1) {
+		close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
+static void
+ids_close(int fd)
+{
+	if (fd != ids_fd)
+		close(fd);
+}
+
+/*
+ * Read the whole state file.  Returns false, with f left empty, if it
+ * does not parse.  Expired reservations are dropped on the way in.
+ */
+static bool
+ids_read(int fd, struct ids_file *f)
+{
+	FILE *fp;
+	struct ids_sect *s;
+	struct ids_rsv r;
+	char *line = NULL;
+	char name[4];
+	size_t linecap = 0, i;
+	time_t now;
+	bool ok = false;
+	int k, dfd;
+
+	memset(f, 0, sizeof(*f));
+	if ((dfd = dup(fd)) == -1 || lseek(dfd, 0, SEEK_SET) == -1 ||
+	    (fp = fdopen(dfd, "r")) == NULL) {
+		if (dfd != -1)
+			close(dfd);
+		return (false);
+	}
+	now = time(NULL);
+	while (getline(&line, &linecap, fp) > 0) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (strncmp(line, "rsv ", 4) == 0) {
+			if (sscanf(line + 4, "%3s %ju %ju %jd", name, &r.lo,
+			    &r.hi, &r.expires) != 4 || r.lo > r.hi)
+				goto out;
+			for (k = 0; k < IDS_NKINDS; k++)
+				if (strcmp(name, ids_names[k]) == 0)
+					break;
+			if (k == IDS_NKINDS)
+				goto out;
+			if (r.expires > now)
+				ids_addrsv(f, k, r.lo, r.hi, r.expires);
+			continue;
+		}
+		if (sscanf(line, "%3s", name) != 1)
+			goto out;
+		for (k = 0; k < IDS_NKINDS; k++)
+			if (strcmp(name, ids_names[k]) == 0)
+				break;
+		if (k == IDS_NKINDS || f->sect[k].present)
+			goto out;
+		s = &f->sect[k];
+		if (sscanf(line, "%*3s %ju %ju %ju %ju %ju %jd %jd %jd %zu",
+		    &s->min, &s->max, &s->gen.dev, &s->gen.ino, &s->gen.size,
+		    &s->gen.sec, &s->gen.nsec, &s->hwm, &s->nfree) != 9 ||
+		    s->min > s->max || s->nfree > (s->max - s->min) / 2 + 1)
+			goto out;
+		if ((s->free = reallocarray(NULL, s->nfree ? s->nfree * 2 : 1,
+		    sizeof(*s->free))) == NULL)
+			err(1, "reallocarray()");
+		for (i = 0; i < s->nfree; i++)
+			if (getline(&line, &linecap, fp) <= 0 ||
+			    sscanf(line, "%ju %ju", &s->free[i * 2],
+			    &s->free[i * 2 + 1]) != 2)
+				goto out;
+		s->present = true;
+	}
+	ok = !ferror(fp);
+out:
+	free(line);
+	fclose(fp);
+	if (!ok)
+		ids_free(f);
+	return (ok);
+}
+
+static void
+ids_write(int fd, const struct ids_file *f)
+{
+	FILE *fp;
+	const struct ids_sect *s;
+	const struct ids_rsv *r;
+	size_t i;
+	int k, dfd;
+
+	if ((dfd = dup(fd)) == -1 || lseek(dfd, 0, SEEK_SET) == -1 ||
+	    ftruncate(dfd, 0) == -1 || (fp = fdopen(dfd, "w")) == NULL) {
+		warn("%s", getpwpath(_IDSTATE));
+		if (dfd != -1)
+			close(dfd);
+		return;
+	}
+	fputs("# pw(8) id allocator state, rebuilt automatically\n", fp);
+	for (k = 0; k < IDS_NKINDS; k++) {
+		s = &f->sect[k];
+		if (!s->present)
+			continue;
+		fprintf(fp, "%s %ju %ju %ju %ju %ju %jd %jd %jd %zu\n",
+		    ids_names[k], s->min, s->max, s->gen.dev, s->gen.ino,
+		    s->gen.size, s->gen.sec, s->gen.nsec, s->hwm, s->nfree);
+		for (i = 0; i < s->nfree; i++)
+			fprintf(fp, "%ju %ju\n", s->free[i * 2],
+			    s->free[i * 2 + 1]);
+	}
+	for (i = 0; i < f->nrsv; i++) {
+		r = &f->rsv[i];
+		fprintf(fp, "rsv %s %ju %ju %jd\n", ids_names[r->kind], r->lo,
+		    r->hi, r->expires);
+	}
+	if (fclose(fp) == EOF)
+		warn("%s", getpwpath(_IDSTATE));
+}
+
+/*
+ * Fill bm (relative to min) from a section.
+ */
+static void
+ids_tobm(const struct ids_sect *s, struct bitmap *bm)
+{
+	size_t i;
+
+	if (s->hwm < 0)
+		return;
+	bm_setrange(bm, 0, s->hwm - s->min);
+	for (i = 0; i < s->nfree; i++)
+		bm_clrrange(bm, s->free[i * 2] - s->min,
+		    s->free[i * 2 + 1] - s->min);
+}
+
+/*
+ * Describe bm (relative to min) as a high-water mark and the runs of
+ * free ids below it.
+ */
+static void
+ids_frombm(struct ids_sect *s, uintmax_t min, uintmax_t max,
+    struct bitmap *bm)
+{
+	int64_t pos, end, last;
+	size_t cap;
+
+	ids_dropsect(s);
+	s->present = true;
+	s->min = min;
+	s->max = max;
+	s->hwm = -1;
+	if (bm_nextset(bm, 0) == bm->size)
+		return;
+	last = bm_lastset(bm);
+	s->hwm = last + min;
+	cap = 0;
+	for (pos = bm_nextunset(bm, 0); pos < last;
+	    pos = bm_nextunset(bm, end + 1)) {
+		end = bm_nextset(bm, pos) - 1;
+		if (s->nfree == cap) {
+			cap = cap ? cap * 2 : 16;
+			if ((s->free = reallocarray(s->free, cap * 2,
+			    sizeof(*s->free))) == NULL)
+				err(1, "reallocarray()");
+		}
+		s->free[s->nfree * 2] = pos + min;
+		s->free[s->nfree * 2 + 1] = end + min;
+		s->nfree++;
+	}
+}
+
+/*
+ * Hold the state file exclusively until ids_unlock(), so that choosing
+ * ids and reserving them is atomic with respect to other callers.
+ */
+void
+ids_lock(void)
+{
+	if (ids_fd == -1)
+		ids_fd = ids_open(true, true);
+}
+
+void
+ids_unlock(void)
+{
+	if (ids_fd != -1) {
+		close(ids_fd);
+		ids_fd = -1;
+	}
+}
+
+/*
+ * Fill bm with the ids in use in min..max from the state file, if it
+ * holds that range and is current with respect to the database.
+ * Returns false if the caller has to scan the database instead.
+ */
+bool
+ids_load(enum ids_kind kind, uintmax_t min, uintmax_t max, struct bitmap *bm)
+{
+	struct ids_file f;
+	struct ids_sect *s = &f.sect[kind];
+	bool ok;
+	int fd;
+
+	ids_seenok[kind] = ids_dbgen(kind, &ids_seen[kind]);
+	if (!ids_seenok[kind] || (fd = ids_open(false, false)) == -1)
+		return (false);
+	ok = ids_read(fd, &f);
+	ids_close(fd);
+	if (!ok)
+		return (false);
+	ok = ids_sane(s) && s->min == min && s->max == max &&
+	    ids_samegen(&s->gen, &ids_seen[kind]);
+	if (ok)
+		ids_tobm(s, bm);
+	ids_free(&f);
+	return (ok);
+}
+
+/*
+ * Record bm, as scanned after a failed ids_load(), stamped with the
+ * generation that ids_load() saw; a database changed in the meantime
+ * then simply reads as stale next time.
+ */
+void
+ids_save(enum ids_kind kind, uintmax_t min, uintmax_t max, struct bitmap *bm)
+{
+	struct ids_file f;
+	int fd;
+
+	if (!ids_seenok[kind] || (fd = ids_open(true, true)) == -1)
+		return;
+	ids_read(fd, &f);
+	ids_frombm(&f.sect[kind], min, max, bm);
+	f.sect[kind].gen = ids_seen[kind];
+	ids_write(fd, &f);
+	ids_close(fd);
+	ids_free(&f);
+}
+
+/*
+ * Called once the database has been rewritten.  pre is the database
+ * as it was under the lock; state derived from it is carried forward
+ * by marking the n ids written as used.  Since duplicate ids are allowed, freeing an
+ * id cannot be tracked without a scan, so the state is dropped and the
+ * next allocation rebuilds it.
+ */
+void
+ids_commit(enum ids_kind kind, const struct stat *pre,
+    const uintmax_t *ids, size_t n, bool freed)
+{
+	struct ids_file f;
+	struct ids_sect *s = &f.sect[kind];
+	struct ids_gen gen;
+	struct bitmap bm;
+	size_t i;
+	int fd;
+
+	if ((fd = ids_open(true, false)) == -1)
+		return;
+	if (!ids_read(fd, &f)) {
+		ids_close(fd);
+		return;
+	}
+	ids_getgen(&gen, pre);
+	if (ids_sane(s) && ids_samegen(&s->gen, &gen)) {
+		if (freed || !ids_dbgen(kind, &gen))
+			ids_dropsect(s);
+		else {
+			bm = bm_alloc((int64_t)(s->max - s->min) + 1);
+			ids_tobm(s, &bm);
+			for (i = 0; i < n; i++)
+				if (ids[i] >= s->min && ids[i] <= s->max)
+					bm_setbit(&bm, (int64_t)(ids[i] - s->min));
+			ids_frombm(s, s->min, s->max, &bm);
+			bm_dealloc(&bm);
+			s->gen = gen;
+		}
+		ids_write(fd, &f);
+	}
+	ids_close(fd);
+	ids_free(&f);
+}
+
+/*
+ * Mark ids reserved by other callers that fall within bm, which is
+ * relative to min.
+ */
+void
+ids_reserved(enum ids_kind kind, uintmax_t min, struct bitmap *bm)
+{
+	struct ids_file f;
+	const struct ids_rsv *r;
+	size_t i;
+	int fd;
+
+	if ((fd = ids_open(false, false)) == -1)
+		return;
+	if (ids_read(fd, &f)) {
+		for (i = 0; i < f.nrsv; i++) {
+			r = &f.rsv[i];
+			if (r->kind == (int)kind && r->hi >= min)
+				bm_setrange(bm, r->lo < min ? 0 :
+				    (int64_t)(r->lo - min), (int64_t)(r->hi - min));
+		}
+		ids_free(&f);
+	}
+	ids_close(fd);
+}
+
+/*
+ * Reserve ids for ttl seconds; automatic allocation skips them until
+ * then.  Explicitly requested ids are not affected.
+ */
+void
+ids_reserve(enum ids_kind kind, const uintmax_t *ids, size_t n, time_t ttl)
+{
+	struct ids_file f;
+	intmax_t expires;
+	size_t i;
+	int fd;
+
+	if ((fd = ids_open(true, true)) == -1) {
+		warn("%s", getpwpath(_IDSTATE));
+		return;
+	}
+	ids_read(fd, &f);
+	expires = (intmax_t)time(NULL) + ttl;
+	for (i = 0; i < n; i++)
+		ids_addrsv(&f, kind, ids[i], ids[i], expires);
+	ids_write(fd, &f);
+	ids_close(fd);
+	ids_free(&f);
+}
@@ -0,0 +1,72 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (C) 1996
+ *	David L. Nugent.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DAVID L. NUGENT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL DAVID L. NUGENT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _IDSTATE_H_
+#define _IDSTATE_H_
+
+#include <sys/cdefs.h>
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "bitmap.h"
+
+#ifndef _IDSTATE
+#define _IDSTATE	"pw.idstate"
+#endif
+
+/*
+ * Allocator state kept next to the databases: for each kind, the
+ * configured range, the high-water mark within it and the free ranges
+ * below that mark, stamped with the generation (dev, inode, size and
+ * mtime) of master.passwd or group it was derived from, and any
+ * short-lived reservations handed out by usernext and groupnext.
+ */
+enum ids_kind
+{
+	IDS_UID,
+	IDS_GID,
+	IDS_NKINDS
+};
+
+__BEGIN_DECLS
+bool ids_load(enum ids_kind kind, uintmax_t min, uintmax_t max,
+    struct bitmap *bm);
+void ids_save(enum ids_kind kind, uintmax_t min, uintmax_t max,
+    struct bitmap *bm);
+void ids_commit(enum ids_kind kind, const struct stat *pre,
+    const uintmax_t *ids, size_t n, bool freed);
+void ids_reserved(enum ids_kind kind, uintmax_t min, struct bitmap *bm);
+void ids_reserve(enum ids_kind kind, const uintmax_t *ids, size_t n,
+    time_t ttl);
+void ids_lock(void);
+void ids_unlock(void);
+__END_DECLS
+
+#endif				/* !_IDSTATE_H */
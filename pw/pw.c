@@ -28,7 +28,10 @@
 
 #include <err.h>
 #include <fcntl.h>
+#include <libutil.h>
+#include <limits.h>
 #include <locale.h>
+#include <setjmp.h>
 #include <sys/types.h>
 #include <string.h>
 #include <sysexits.h>
@@ -111,8 +114,24 @@ struct pwconf conf;
 static int	mode = -1;
 static int	which = -1;
 
+/*
+ * Exit status of each command in the current batch group, reported
+ * once the group is committed
+ */
+struct batchst {
+	unsigned long	line;
+	int		rc;
+};
+
+static struct batchst *batchst;
+static size_t	nbatchst, batchstcap;
+static jmp_buf	batchjmp;
+static int	batchrc;
+static bool	incmd;
+
 static int	getindex(const char *words[], const char *word);
 static void	cmdhelp(int mode, int which);
+static int	pw_batch(const char *file, int every);
 
 bool		use_login_cap = false;
 
@@ -130,11 +149,14 @@ main(int argc, char *argv[])
 {
 	int		tmp;
 	struct stat	st;
-	char		arg, *arg1;
-	bool		relocated, nis;
+	char		arg, *arg1, *batch;
+	const char	*errstr;
+	int		every;
+	bool		relocated, nis, serve;
 
-	arg1 = NULL;
-	relocated = nis = false;
+	arg1 = batch = NULL;
+	every = 0;
+	relocated = nis = serve = false;
 	memset(&conf, 0, sizeof(conf));
 	strlcpy(conf.rootdir, _PATH_ROOT, sizeof(conf.rootdir));
 	strlcpy(conf.etcpath, _PATH_PWD, sizeof(conf.etcpath));
@@ -203,6 +225,37 @@ main(int argc, char *argv[])
 					    "Cannot open metalog `%s'",
 					    optarg);
 				conf.metalog = fdopen(fd, "ae");
+			} else if (mode == -1 && which == -1 && arg == 'J' &&
+			    argv[1][2] == '\0') {
+				conf.journal = true;
+			} else if (mode == -1 && which == -1 &&
+			    (arg == 'f' || arg == 'B' || arg == 'W')) {
+				optarg = &argv[1][2];
+				if (*optarg == '\0') {
+					optarg = argv[2];
+					++argv;
+					--argc;
+				}
+				if (optarg == NULL)
+					errx(EX_USAGE, "option -%c requires an "
+					    "argument", arg);
+				if (arg == 'f')
+					batch = optarg;
+				else if (arg == 'W') {
+					conf.lockwait = strtonum(optarg, 1,
+					    INT_MAX, &errstr);
+					if (errstr != NULL)
+						errx(EX_USAGE, "invalid lock "
+						    "wait `%s': %s", optarg,
+						    errstr);
+				} else {
+					every = strtonum(optarg, 1, INT_MAX,
+					    &errstr);
+					if (errstr != NULL)
+						errx(EX_USAGE, "invalid batch "
+						    "size `%s': %s", optarg,
+						    errstr);
+				}
 			} else
 				break;
 		} else if (mode == -1 && (tmp = getindex(Modes, argv[1])) != -1)
@@ -214,10 +267,15 @@ main(int argc, char *argv[])
 			  (tmp = getindex(Combo2, argv[1])) != -1)) {
 			which = tmp / M_NUM;
 			mode = tmp % M_NUM;
-		} else if (strcmp(argv[1], "help") == 0 && argv[2] == NULL)
+		} else if (mode == -1 && which == -1 && !serve &&
+		    strcmp(argv[1], "serve") == 0)
+			serve = true;
+		else if (strcmp(argv[1], "help") == 0 && argv[2] == NULL)
 			cmdhelp(mode, which);
-		else if (which != -1 && mode != -1)
+		else if (which != -1 && mode != -1 && arg1 == NULL)
 			arg1 = argv[1];
+		else if (arg1 != NULL)
+			break;		/* more names, for the command */
 		else
 			errx(EX_USAGE, "unknown keyword `%s'", argv[1]);
 		++argv;
@@ -228,23 +286,335 @@ main(int argc, char *argv[])
 	use_login_cap = login_cap_available();
 #endif
 
+	if (serve && (batch != NULL || mode != -1 || which != -1 ||
+	    argc > 1))
+		errx(EX_USAGE, "serve takes no command");
+	if (batch != NULL && (mode != -1 || which != -1))
+		errx(EX_USAGE, "-f cannot be combined with a command");
+	if (batch == NULL && !serve && every != 0)
+		errx(EX_USAGE, "-B can only be used with -f or serve");
+
 	/*
 	 * Bail out unless the user is specific!
 	 */
-	if (mode == -1 || which == -1)
+	if (batch == NULL && !serve && (mode == -1 || which == -1))
 		cmdhelp(mode, which);
 
+	/*
+	 * Have a running pw serve for these files do the work
+	 */
+	if (batch == NULL && !serve && conf.metalog == NULL &&
+	    (tmp = pw_forward(Combo1[which * M_NUM + mode], arg1,
+	    argc - 1, argv + 1)) != -1)
+		return (tmp);
+
 	conf.rootfd = open(conf.rootdir, O_DIRECTORY|O_CLOEXEC);
 	if (conf.rootfd == -1)
 		errx(EXIT_FAILURE, "Unable to open '%s'", conf.rootdir);
 
+	if (batch != NULL)
+		return (pw_batch(batch, every));
+	if (serve)
+		return (pw_serve(every));
+
 	if (conf.metalog != NULL && (which != W_USER || mode != M_ADD))
 		errx(EXIT_FAILURE,
 	    "metalog can only be specified with 'useradd'");
 
-	return (cmdfunc[which][mode](argc, argv, arg1));
+	/*
+	 * Every change a command makes is applied in one commit
+	 */
+	pw_txbegin();
+	tmp = cmdfunc[which][mode](argc, argv, arg1);
+	if (pw_txend() == -1)
+		err(EX_IOERR, "update");
+	nis_flush();
+	return (tmp);
+}
+
+
+/*
+ * Split a command line into words, in place.  Words are separated by
+ * blanks and may be quoted with ' or ", or have characters escaped
+ * with a backslash, as in sh(1); a word starting with # ends the line.
+ * argv[0] is left for the caller.  Returns -1 on an unmatched quote.
+ */
+static int
+batch_split(char *p, char ***argvp)
+{
+	char	**argv, *q, quote, c;
+	int	argc, cap;
+
+	argc = 1;
+	cap = 8;
+	if ((argv = calloc(cap, sizeof(*argv))) == NULL)
+		err(EX_OSERR, "calloc()");
+	for (;;) {
+		while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+			p++;
+		if (*p == '\0' || *p == '#')
+			break;
+		if (argc + 2 > cap) {
+			cap *= 2;
+			if ((argv = reallocarray(argv, cap,
+			    sizeof(*argv))) == NULL)
+				err(EX_OSERR, "reallocarray()");
+		}
+		argv[argc++] = q = p;
+		for (quote = '\0'; *p != '\0'; p++) {
+			if (quote != '\0') {
+				if (*p == quote)
+					quote = '\0';
+				else if (*p == '\\' && quote == '"' &&
+				    p[1] != '\0')
+					*q++ = *++p;
+				else
+					*q++ = *p;
+			} else if (*p == '\'' || *p == '"')
+				quote = *p;
+			else if (*p == '\\' && p[1] != '\0')
+				*q++ = *++p;
+			else if (*p == ' ' || *p == '\t' || *p == '\r' ||
+			    *p == '\n')
+				break;
+			else
+				*q++ = *p;
+		}
+		if (quote != '\0') {
+			free(argv);
+			return (-1);
+		}
+		c = *p;
+		*q = '\0';
+		if (c != '\0')
+			p++;
+	}
+	argv[argc] = NULL;
+	*argvp = argv;
+	return (argc);
+}
+
+/*
+ * Run one command of a batch: the keywords, as on the command line,
+ * followed by the command's own arguments.
+ */
+static int
+batch_cmd(int argc, char **argv)
+{
+	int	w, m, tmp;
+	char	*arg1;
+
+	w = m = -1;
+	arg1 = NULL;
+	if (argc > 1 && strcmp(argv[1], "pw") == 0) {
+		++argv;
+		--argc;
+	}
+	while (argc > 1 && *argv[1] != '-') {
+		if (m == -1 && (tmp = getindex(Modes, argv[1])) != -1)
+			m = tmp;
+		else if (w == -1 && (tmp = getindex(Which, argv[1])) != -1)
+			w = tmp;
+		else if ((m == -1 && w == -1) &&
+			 ((tmp = getindex(Combo1, argv[1])) != -1 ||
+			  (tmp = getindex(Combo2, argv[1])) != -1)) {
+			w = tmp / M_NUM;
+			m = tmp % M_NUM;
+		} else if (w != -1 && m != -1 && arg1 == NULL)
+			arg1 = argv[1];
+		else if (arg1 != NULL)
+			break;
+		else
+			errx(EX_USAGE, "unknown keyword `%s'", argv[1]);
+		++argv;
+		--argc;
+	}
+	if (m == -1 || w == -1)
+		errx(EX_USAGE, "incomplete command");
+	if (conf.metalog != NULL && (w != W_USER || m != M_ADD))
+		errx(EXIT_FAILURE,
+	    "metalog can only be specified with 'useradd'");
+
+	/* For usage() */
+	mode = m;
+	which = w;
+	optreset = 1;
+	optind = 1;
+	return (cmdfunc[w][m](argc, argv, arg1));
+}
+
+/*
+ * err(3) exit hook while a batch command runs: abandon the command
+ * rather than the batch.
+ */
+static void
+batch_fail(int eval)
+{
+	batchrc = eval != 0 ? eval : EXIT_FAILURE;
+	longjmp(batchjmp, 1);
+}
+
+/*
+ * Release what err(3) may have left open in the middle of a command or
+ * a commit: the file pw.conf was read from, and the locks and temporary
+ * files of the databases.  One-shot pw leaves that to exit(3); a batch
+ * or pw serve goes on.
+ */
+void
+pw_abandon(void)
+{
+	abort_userconfig();
+	pw_fini();
+	gr_fini();
+	pw_unlockwait();
+}
+
+/*
+ * Run one command of a batch, or of pw serve, in argv[1] onwards,
+ * within the open transaction.  A command that fails, even by calling
+ * err(3), has its changes rolled back; its exit status is returned.
+ */
+int
+pw_runcmd(int argc, char **argv)
+{
+	size_t	mark;
+	int	rc;
+
+	mark = pw_txsave();
+	pw_txbegin();
+	if (setjmp(batchjmp) == 0) {
+		err_set_exit(batch_fail);
+		incmd = true;
+		rc = batch_cmd(argc, argv);
+	} else {
+		pw_abandon();
+		rc = batchrc;
+	}
+	incmd = false;
+	err_set_exit(NULL);
+	if (rc != 0)
+		pw_txrollback(mark);
+	pw_txend();
+	mode = which = -1;
+	return (rc);
+}
+
+/*
+ * Print the status of each command in the group, with rc standing in
+ * for those that succeeded but were not committed.
+ */
+static void
+batch_report(int rc)
+{
+	size_t	i;
+
+	for (i = 0; i < nbatchst; i++)
+		printf("%lu %d\n", batchst[i].line,
+		    batchst[i].rc != 0 ? batchst[i].rc : rc);
+	fflush(stdout);
+	nbatchst = 0;
 }
 
+/*
+ * err(3) exit hook while a group is committed: the batch cannot go on.
+ */
+static void
+batch_fatal(int eval)
+{
+	batch_report(eval);
+}
+
+static void
+batch_flush(void)
+{
+	err_set_exit(batch_fatal);
+	if (pw_txcommit() == -1) {
+		warn("update");
+		batch_report(EX_IOERR);
+		exit(EX_IOERR);
+	}
+	err_set_exit(NULL);
+	batch_report(EXIT_SUCCESS);
+}
+
+/*
+ * Run the commands in file ("-" for standard input), one per line, in
+ * a single process.  Changes are committed after every `every' commands,
+ * or all at once at the end if that is 0.  The changes of a command that
+ * fails are rolled back and the rest carry on; the line number and exit
+ * status of each command are printed once its group is committed.
+ */
+static int
+pw_batch(const char *file, int every)
+{
+	FILE		*fp;
+	struct pwconf	 saved;
+	char		*buf, *line, **argv;
+	size_t		 bufcap;
+	ssize_t		 len;
+	unsigned long	 lineno;
+	int		 argc, rc, status, ops, errfd;
+
+	if (strcmp(file, "-") == 0)
+		fp = stdin;
+	else if ((fp = fopen(file, "re")) == NULL)
+		err(EX_NOINPUT, "%s", file);
+	if ((errfd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0)) == -1)
+		err(EX_OSERR, "fcntl()");
+
+	buf = NULL;
+	bufcap = 0;
+	lineno = 0;
+	status = EXIT_SUCCESS;
+	ops = 0;
+	saved = conf;
+	pw_txbegin();
+	while ((len = getline(&buf, &bufcap, fp)) != -1) {
+		lineno++;
+		/* Commands may keep pointers into their arguments */
+		if ((line = strdup(buf)) == NULL)
+			err(EX_OSERR, "strdup()");
+		if ((argc = batch_split(line, &argv)) == -1) {
+			warnx("line %lu: unmatched quote", lineno);
+			rc = EX_DATAERR;
+		} else if (argc == 1) {
+			free(argv);
+			free(line);
+			continue;
+		} else {
+			argv[0] = "pw";
+			conf = saved;
+			rc = pw_runcmd(argc, argv);
+			free(argv);
+			/* -q sends stderr to /dev/null */
+			fflush(stderr);
+			dup2(errfd, STDERR_FILENO);
+		}
+		if (nbatchst == batchstcap) {
+			batchstcap = batchstcap ? batchstcap * 2 : 64;
+			if ((batchst = reallocarray(batchst, batchstcap,
+			    sizeof(*batchst))) == NULL)
+				err(EX_OSERR, "reallocarray()");
+		}
+		batchst[nbatchst].line = lineno;
+		batchst[nbatchst].rc = rc;
+		nbatchst++;
+		if (rc != 0)
+			status = rc;
+		if (every > 0 && ++ops % every == 0)
+			batch_flush();
+	}
+	if (ferror(fp))
+		err(EX_IOERR, "%s", file);
+	batch_flush();
+	pw_txend();
+	nis_flush();
+	free(buf);
+	if (fp != stdin)
+		fclose(fp);
+	close(errfd);
+	return (status);
+}
 
 static int
 getindex(const char *words[], const char *word)
@@ -269,7 +639,9 @@ static void
 cmdhelp(int mode, int which)
 {
 	if (which == -1)
-		fprintf(stderr, "usage:\n  pw [user|group|lock|unlock] [add|del|mod|show|next] [help|switches/values]\n");
+		fprintf(stderr, "usage:\n  pw [-J] [-W seconds] [user|group|lock|unlock] [add|del|mod|show|next] [help|switches/values]\n"
+		    "  pw [-J] [-W seconds] [-B count] -f file\n"
+		    "  pw [-J] [-W seconds] [-B count] serve\n");
 	else if (mode == -1)
 		fprintf(stderr, "usage:\n  pw %s [add|del|mod|show|next] [help|switches/values]\n", Which[which]);
 	else {
@@ -352,7 +724,7 @@ cmdhelp(int mode, int which)
 				"\t-Y             update NIS maps\n"
 				"\t-y path        set NIS passwd file path\n"
 				"\t-N             no update\n",
-				"usage: pw usershow [uid|name] [switches]\n"
+				"usage: pw usershow [uid|name ...] [switches] [uid|name|- ...]\n"
 				"\t-V etcdir      alternate /etc location\n"
 				"\t-R rootdir     alternate root directory\n"
 				"\t-n name        login name\n"
@@ -360,12 +732,18 @@ cmdhelp(int mode, int which)
 				"\t-F             force print\n"
 				"\t-P             prettier format\n"
 				"\t-a             print all users\n"
-				"\t-7             print in v7 format\n",
+				"\t-7             print in v7 format\n"
+				"\t-o format      print as jsonl or csv\n"
+				"\t-w field<op>v  print users that match\n"
+				"\t-s name|uid    sort users\n"
+				"\t-l count       print at most count users\n",
 				"usage: pw usernext [switches]\n"
 				"\t-V etcdir      alternate /etc location\n"
 				"\t-R rootdir     alternate root directory\n"
 				"\t-C config      configuration file\n"
-				"\t-q             quiet operation\n",
+				"\t-q             quiet operation\n"
+				"\t-c count       number of uid:gid pairs\n"
+				"\t-t seconds     reserve the ids for this long\n",
 				"usage pw: lock [switches]\n"
 				"\t-V etcdir      alternate /etc locations\n"
 				"\t-C config      configuration file\n"
@@ -407,24 +785,32 @@ cmdhelp(int mode, int which)
 				"\t-l name        new group name\n"
 				"\t-Y             update NIS maps\n"
 				"\t-N             no update\n",
-				"usage: pw groupshow [group|gid] [switches]\n"
+				"usage: pw groupshow [group|gid ...] [switches] [group|gid|- ...]\n"
 				"\t-V etcdir      alternate /etc location\n"
 				"\t-R rootdir     alternate root directory\n"
 				"\t-n name        group name\n"
 				"\t-g gid         group id\n"
 				"\t-F             force print\n"
 				"\t-P             prettier format\n"
-				"\t-a             print all accounting groups\n",
+				"\t-a             print all accounting groups\n"
+				"\t-o format      print as jsonl or csv\n"
+				"\t-w field<op>v  print groups that match\n"
+				"\t-s name|gid    sort groups\n"
+				"\t-l count       print at most count groups\n",
 				"usage: pw groupnext [switches]\n"
 				"\t-V etcdir      alternate /etc location\n"
 				"\t-R rootdir     alternate root directory\n"
 				"\t-C config      configuration file\n"
 				"\t-q             quiet operation\n"
+				"\t-c count       number of gids\n"
+				"\t-t seconds     reserve the gids for this long\n"
 			}
 		};
 
 		fprintf(stderr, "%s", help[which][mode]);
 	}
+	if (incmd)
+		batch_fail(EX_USAGE);
 	exit(EX_USAGE);
 }
 
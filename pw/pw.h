@@ -34,6 +34,7 @@
 #include <stdbool.h>
 
 #include "pwupd.h"
+#include "bitmap.h"
 
 #ifdef __APPLE__
 #define PW_UID_PRI "jd"
@@ -79,6 +80,13 @@ enum _which
 	W_NUM
 };
 
+enum _outfmt
+{
+	PWOUT_NONE,
+	PWOUT_JSONL,
+	PWOUT_CSV
+};
+
 #define _DEF_DIRMODE	(S_IRWXU | S_IRWXG | S_IRWXO)
 #define _PW_CONF	"pw.conf"
 #define _UC_MAXLINE	1024
@@ -86,6 +94,7 @@ enum _which
 
 struct userconf *get_userconfig(const char *cfg);
 struct userconf *read_userconfig(char const * file);
+void abort_userconfig(void);
 int write_userconfig(struct userconf *cnf, char const * file);
 
 void metalog_emit(const char *path, mode_t mode, uid_t uid, gid_t gid,
@@ -109,11 +118,16 @@ int pw_user_next(int argc, char **argv, char *name);
 int pw_user_show(int argc, char **argv, char *name);
 int pw_user_unlock(int argc, char **argv, char *name);
 int pw_groupnext(struct userconf *cnf, bool quiet);
+bool pw_gidknown(struct userconf *cnf, struct bitmap *bm);
+void pw_gidscanned(struct userconf *cnf, struct bitmap *bm);
+struct bitmap pw_gidused(struct userconf *cnf);
+gid_t pw_gidtake(struct userconf *cnf, struct bitmap *bm, intmax_t prefer);
 char *pw_checkname(char *name, int gecos);
 uintmax_t pw_checkid(char *nptr, uintmax_t maxval);
 intmax_t pw_checkuid(char *nptr);
 intmax_t pw_checkgid(char *nptr);
 bool pw_id_numeric(const char *nptr);
+void pw_addkey(StringList **keys, const char *key);
 int pw_checkfd(char *nptr);
 
 int addnispwent(const char *path, struct passwd *pwd);
@@ -124,12 +138,37 @@ int groupadd(struct userconf *, char *name, gid_t id, char *members, int fd,
     bool dryrun, bool pretty, bool precrypted);
 
 int nis_update(void);
+int nis_flush(void);
+bool nis_pending(void);
 
 int boolean_val(char const * str, int dflt);
 int passwd_val(char const * str, int dflt);
 char const *boolean_str(int val);
 char *newstr(char const * p);
 
+int pw_outformat(const char *name);
+void pw_outbegin(int format, int which);
+void pw_outuser(const struct passwd *pwd, const char *group,
+    StringList *groups);
+void pw_outgroup(const struct group *grp);
+void pw_outend(void);
+
+struct pwquery;
+
+struct pwquery *pw_query_new(int which);
+void pw_query_where(struct pwquery *q, const char *expr);
+void pw_query_sort(struct pwquery *q, const char *key);
+void pw_query_limit(struct pwquery *q, const char *count);
+bool pw_query_needgroups(const struct pwquery *q);
+const char *pw_query_key(const struct pwquery *q, intmax_t *id);
+bool pw_query_user(const struct pwquery *q, const struct passwd *pwd,
+    const char *group, StringList *groups);
+bool pw_query_group(const struct pwquery *q, const struct group *grp);
+bool pw_query_take(struct pwquery *q, const void *rec);
+bool pw_query_done(const struct pwquery *q);
+void *pw_query_next(struct pwquery *q);
+void pw_query_free(struct pwquery *q);
+
 void pw_log(struct userconf * cnf, int mode, int which, char const * fmt,...) __printflike(4, 5);
 char *pw_pwcrypt(char *password);
 
@@ -148,3 +187,7 @@ int chflagsat(int fd, const char *path, unsigned long flags, int atflag);
 extern bool use_login_cap;
 
 void usage(void);
+void pw_abandon(void);
+int pw_runcmd(int argc, char **argv);
+int pw_serve(int every);
+int pw_forward(const char *cmd, const char *name, int argc, char **argv);
@@ -42,6 +42,7 @@ enum {
 	_UC_DEFAULTPWD,
 	_UC_REUSEUID,
 	_UC_REUSEGID,
+	_UC_IDSTATE,
 	_UC_NISPASSWD,
 	_UC_DOTDIR,
 	_UC_NEWMAIL,
@@ -86,6 +87,7 @@ static struct userconf config =
 	0,			/* Default password for new users? (nologin) */
 	0,			/* Reuse uids? */
 	0,			/* Reuse gids? */
+	0,			/* Keep id allocator state? */
 	NULL,			/* NIS version of the passwd file */
 	_PATH_SKEL,		/* Where to obtain skeleton files */
 	NULL,			/* Mail to send to new accounts */
@@ -104,12 +106,27 @@ static struct userconf config =
 	0			/* Days until password expires */
 };
 
+/*
+ * File config was last read from and the generation read, so that
+ * batches and pw serve read it again only once it changes
+ */
+static char cfgread[MAXPATHLEN];
+static struct stat cfgstat;
+static bool cfgfound;
+static struct userconf cfgdefault;
+static bool cfgsaved;
+
+/* The file being read, and its line, until read_userconfig() is done */
+static FILE *cfgfp;
+static char *cfgbuf;
+
 static char const *comments[_UC_FIELDS] =
 {
 	"#\n# pw.conf - user/group configuration defaults\n#\n",
 	"\n# Password for new users? no=nologin yes=loginid none=blank random=random\n",
 	"\n# Reuse gaps in uid sequence? (yes or no)\n",
 	"\n# Reuse gaps in gid sequence? (yes or no)\n",
+	"\n# Keep allocator state to find new ids without a scan? (yes or no)\n",
 	"\n# Path to the NIS passwd file (blank or 'no' for none)\n",
 	"\n# Obtain default dotfiles from this directory\n",
 	"\n# Mail this file to new user (/etc/newuser.msg or no)\n",
@@ -136,6 +153,7 @@ static char const *kwds[] =
 	"defaultpasswd",
 	"reuseuids",
 	"reusegids",
+	"idstate",
 	"nispasswd",
 	"skeleton",
 	"newmail",
@@ -247,14 +265,33 @@ read_userconfig(char const * file)
 	const char *errstr;
 	size_t	linecap;
 	ssize_t	linelen;
+	struct stat st;
+	bool	found;
 
 	buf = NULL;
 	linecap = 0;
 
+	found = stat(file, &st) == 0;
+	if (strcmp(file, cfgread) == 0 && found == cfgfound && (!found ||
+	    (st.st_dev == cfgstat.st_dev && st.st_ino == cfgstat.st_ino &&
+	    st.st_size == cfgstat.st_size &&
+	    st.st_mtim.tv_sec == cfgstat.st_mtim.tv_sec &&
+	    st.st_mtim.tv_nsec == cfgstat.st_mtim.tv_nsec)))
+		return (&config);
+	if (!cfgsaved) {
+		cfgdefault = config;
+		cfgsaved = true;
+	} else
+		config = cfgdefault;
+	strlcpy(cfgread, file, sizeof(cfgread));
+	cfgstat = st;
+	cfgfound = found;
 	if ((fp = fopen(file, "r")) == NULL)
 		return (&config);
+	cfgfp = fp;
 
 	while ((linelen = getline(&buf, &linecap, fp)) > 0) {
+		cfgbuf = buf;
 		if (*buf && (p = strtok(buf, " \t\r\n=")) != NULL && *p != '#') {
 			static char const toks[] = " \t\r\n,=";
 			char           *q = strtok(NULL, toks);
@@ -279,6 +316,9 @@ read_userconfig(char const * file)
 			case _UC_REUSEGID:
 				config.reuse_gids = boolean_val(q, 0);
 				break;
+			case _UC_IDSTATE:
+				config.idstate = boolean_val(q, 0);
+				break;
 			case _UC_NISPASSWD:
 				config.nispasswd = (q == NULL || !boolean_val(q, 1))
 					? NULL : newstr(q);
@@ -398,10 +438,28 @@ read_userconfig(char const * file)
 	}
 	free(buf);
 	fclose(fp);
+	cfgfp = NULL;
+	cfgbuf = NULL;
 
 	return (&config);
 }
 
+/*
+ * Called when err(3) has cut a command short, perhaps in the middle of
+ * read_userconfig() rejecting a value: release the file and forget
+ * what was read of it, so that it is read afresh.
+ */
+void
+abort_userconfig(void)
+{
+	if (cfgfp != NULL)
+		fclose(cfgfp);
+	free(cfgbuf);
+	cfgfp = NULL;
+	cfgbuf = NULL;
+	cfgread[0] = '\0';
+}
+
 
 int
 write_userconfig(struct userconf *cnf, const char *file)
@@ -420,6 +478,7 @@ write_userconfig(struct userconf *cnf, const char *file)
 		file = cfgfile;
 	}
 
+	cfgread[0] = '\0';
 	if ((fd = open(file, O_CREAT|O_RDWR|O_TRUNC|O_EXLOCK, 0644)) == -1)
 		return (0);
 
@@ -450,6 +509,9 @@ write_userconfig(struct userconf *cnf, const char *file)
 		case _UC_REUSEGID:
 			fputs(boolean_str(cnf->reuse_gids), buffp);
 			break;
+		case _UC_IDSTATE:
+			fputs(boolean_str(cnf->idstate ? P_YES : P_NO), buffp);
+			break;
 		case _UC_NISPASSWD:
 			fputs(cnf->nispasswd ?  cnf->nispasswd : "", buffp);
 			quote = 0;
@@ -38,6 +38,7 @@
 
 #include "pw.h"
 #include "bitmap.h"
+#include "idstate.h"
 
 static struct passwd *lookup_pwent(const char *user);
 static void	delete_members(struct group *grp, char *list);
@@ -193,33 +194,109 @@ gr_gidpolicy(struct userconf * cnf, intmax_t id)
 	 * two policies a) Grab the first unused gid b) Grab the
 	 * highest possible unused gid
 	 */
+	bm = pw_gidused(cnf);
+	gid = pw_gidtake(cnf, &bm, -1);
+	bm_dealloc(&bm);
+	return (gid);
+}
+
+/*
+ * Start the set of gids in use in the configured range, relative to
+ * min_gid, from what is known without reading the group file.  If that
+ * is not enough the set is left empty and false returned: the caller
+ * fills it from a walk of the group file and hands it to
+ * pw_gidscanned().
+ */
+bool
+pw_gidknown(struct userconf *cnf, struct bitmap *bm)
+{
+
 	if (cnf->min_gid >= cnf->max_gid) {	/* Sanity claus^H^H^H^Hheck */
 		cnf->min_gid = 1000;
 		cnf->max_gid = 32000;
 	}
-	bm = bm_alloc(cnf->max_gid - cnf->min_gid + 1);
 
 	/*
-	 * Now, let's fill the bitmap from the password file
+	 * Earlier commands in this transaction may have built the set
+	 * already
 	 */
-	SETGRENT();
-	while ((grp = GETGRENT()) != NULL)
-		if ((gid_t)grp->gr_gid >= (gid_t)cnf->min_gid &&
-		    (gid_t)grp->gr_gid <= (gid_t)cnf->max_gid)
-			bm_setbit(&bm, grp->gr_gid - cnf->min_gid);
-	ENDGRENT();
+	if (pw_txidget(PWTX_GR, cnf->min_gid, cnf->max_gid, bm))
+		return (true);
+	*bm = bm_alloc((int64_t)cnf->max_gid - cnf->min_gid + 1);
+	if (!cnf->idstate ||
+	    !ids_load(IDS_GID, cnf->min_gid, cnf->max_gid, bm))
+		return (false);
+	pw_txidput(PWTX_GR, cnf->min_gid, cnf->max_gid, bm);
+	return (true);
+}
+
+/*
+ * Keep a set filled from the group file for later commands.
+ */
+void
+pw_gidscanned(struct userconf *cnf, struct bitmap *bm)
+{
+
+	if (cnf->idstate)
+		ids_save(IDS_GID, cnf->min_gid, cnf->max_gid, bm);
+	pw_txidput(PWTX_GR, cnf->min_gid, cnf->max_gid, bm);
+}
+
+/*
+ * Build the set of gids in use in the configured range, relative to
+ * min_gid, including those reserved by other callers.
+ */
+struct bitmap
+pw_gidused(struct userconf *cnf)
+{
+	struct group   *grp;
+	struct bitmap   bm;
+
+	if (!pw_gidknown(cnf, &bm)) {
+		SETGRENT();
+		while ((grp = GETGRENT()) != NULL)
+			if ((gid_t)grp->gr_gid >= (gid_t)cnf->min_gid &&
+			    (gid_t)grp->gr_gid <= (gid_t)cnf->max_gid)
+				bm_setbit(&bm, grp->gr_gid - cnf->min_gid);
+		ENDGRENT();
+		pw_gidscanned(cnf, &bm);
+	}
+	ids_reserved(IDS_GID, cnf->min_gid, &bm);
+	return (bm);
+}
+
+/*
+ * Choose a gid from a set built by pw_gidused() and mark it as used.
+ * A prefer of 0 or more is taken if no group has that gid, even outside
+ * the configured range, so that a new user's uid and gid can match.
+ */
+gid_t
+pw_gidtake(struct userconf *cnf, struct bitmap *bm, intmax_t prefer)
+{
+	gid_t           gid = (gid_t) - 1;
+
+	if (prefer >= 0) {
+		gid = (gid_t) prefer;
+		if (gid >= cnf->min_gid && gid <= cnf->max_gid) {
+			if (!bm_isset(bm, gid - cnf->min_gid)) {
+				bm_setbit(bm, gid - cnf->min_gid);
+				return (gid);
+			}
+		} else if (GETGRGID(gid) == NULL)
+			return (gid);
+	}
 
 	/*
 	 * Then apply the policy, with fallback to reuse if necessary
 	 */
 	if (cnf->reuse_gids)
-		gid = (gid_t) (bm_firstunset(&bm) + cnf->min_gid);
+		gid = (gid_t) (bm_firstunset(bm) + cnf->min_gid);
 	else {
-		gid = (gid_t) (bm_lastset(&bm) + 1);
-		if (!bm_isset(&bm, gid))
+		gid = (gid_t) (bm_lastset(bm) + 1);
+		if (!bm_isset(bm, gid))
 			gid += cnf->min_gid;
 		else
-			gid = (gid_t) (bm_firstunset(&bm) + cnf->min_gid);
+			gid = (gid_t) (bm_firstunset(bm) + cnf->min_gid);
 	}
 
 	/*
@@ -228,7 +305,7 @@ gr_gidpolicy(struct userconf * cnf, intmax_t id)
 	if (gid < cnf->min_gid || gid > cnf->max_gid)
 		errx(EX_SOFTWARE, "unable to allocate a new gid - range fully "
 		    "used");
-	bm_dealloc(&bm);
+	bm_setbit(bm, gid - cnf->min_gid);
 	return (gid);
 }
 
@@ -260,18 +337,34 @@ int
 pw_group_next(int argc, char **argv, char *arg1 __unused)
 {
 	struct userconf *cnf;
+	struct bitmap bm;
 	const char *cfg = NULL;
+	const char *errstr;
+	uintmax_t *gids;
+	intmax_t count = 0, ttl = 0, i;
 	int ch;
 	bool quiet = false;
 
-	while ((ch = getopt(argc, argv, "C:q")) != -1) {
+	while ((ch = getopt(argc, argv, "C:c:qt:")) != -1) {
 		switch (ch) {
 		case 'C':
 			cfg = optarg;
 			break;
+		case 'c':
+			count = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr)
+				errx(EX_USAGE, "count is %s: `%s'", errstr,
+				    optarg);
+			break;
 		case 'q':
 			quiet = true;
 			break;
+		case 't':
+			ttl = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr)
+				errx(EX_USAGE, "reservation time is %s: `%s'",
+				    errstr, optarg);
+			break;
 		default:
 			usage();
 		}
@@ -284,19 +377,127 @@ pw_group_next(int argc, char **argv, char *arg1 __unused)
 	if (quiet)
 		freopen(_PATH_DEVNULL, "w", stderr);
 	cnf = get_userconfig(cfg);
-	return (pw_groupnext(cnf, quiet));
+	if (count == 0 && ttl == 0)
+		return (pw_groupnext(cnf, quiet));
+
+	/*
+	 * Hand out distinct gids from one pass over the group file, and
+	 * optionally reserve them for ttl seconds.
+	 */
+	if (count == 0)
+		count = 1;
+	if ((gids = calloc(count, sizeof(*gids))) == NULL)
+		err(EX_OSERR, "calloc()");
+	if (ttl > 0)
+		ids_lock();
+	bm = pw_gidused(cnf);
+	for (i = 0; i < count; i++)
+		gids[i] = pw_gidtake(cnf, &bm, -1);
+	if (ttl > 0) {
+		ids_reserve(IDS_GID, gids, count, ttl);
+		ids_unlock();
+	}
+	for (i = 0; i < count; i++)
+		printf("%" PW_GID_PRI "\n", PW_GID_ARG(gids[i]));
+	bm_dealloc(&bm);
+	free(gids);
+	return (EXIT_SUCCESS);
+}
+
+static void
+show_group(struct group *grp, int format, bool pretty)
+{
+	if (format != PWOUT_NONE)
+		pw_outgroup(grp);
+	else
+		print_group(grp, pretty);
+}
+
+/*
+ * Print the groups that match q, in a single pass over the database,
+ * or by a lookup if q names the group.  A gid is looked up too, but
+ * only to find there is nobody to print: gids may be shared.
+ */
+static void
+show_query(struct pwquery *q, int format, bool pretty)
+{
+	struct group *grp;
+	const char *name;
+	intmax_t id;
+
+	if ((name = pw_query_key(q, &id)) != NULL || id >= 0) {
+		grp = name != NULL ? GETGRNAM(name) : GETGRGID(id);
+		if (grp == NULL)
+			return;
+	}
+	if (name != NULL) {
+		if (pw_query_group(q, grp) && pw_query_take(q, grp))
+			show_group(grp, format, pretty);
+	} else {
+		SETGRENT();
+		while ((grp = GETGRENT()) != NULL) {
+			if (!pw_query_group(q, grp))
+				continue;
+			if (pw_query_take(q, grp))
+				show_group(grp, format, pretty);
+			if (pw_query_done(q))
+				break;
+		}
+		ENDGRENT();
+	}
+	while ((grp = pw_query_next(q)) != NULL)
+		show_group(grp, format, pretty);
+}
+
+/*
+ * Print the groups named, or numbered, by keys in the order given, each
+ * found through the group index rather than a scan.  One not found is
+ * reported and skipped, or printed as fake if given.
+ */
+static int
+show_keys(StringList *keys, int format, bool pretty, struct group *fake)
+{
+	struct group *grp;
+	char *key;
+	size_t i;
+	int rc;
+
+	if (format != PWOUT_NONE)
+		pw_outbegin(format, W_GROUP);
+	rc = EXIT_SUCCESS;
+	for (i = 0; i < keys->sl_cur; i++) {
+		key = keys->sl_str[i];
+		grp = pw_id_numeric(key) ? GETGRGID(pw_checkgid(key)) :
+		    GETGRNAM(key);
+		if (grp == NULL) {
+			if (fake == NULL) {
+				warnx("unknown group `%s'", key);
+				rc = EX_DATAERR;
+				continue;
+			}
+			grp = fake;
+		}
+		show_group(grp, format, pretty);
+	}
+	if (format != PWOUT_NONE)
+		pw_outend();
+	sl_free(keys, 1);
+	return (rc);
 }
 
 int
 pw_group_show(int argc, char **argv, char *arg1)
 {
 	struct group *grp = NULL;
+	struct pwquery *q = NULL;
+	StringList *keys = NULL;
 	char *name = NULL;
 	intmax_t id = -1;
-	int ch;
-	bool all, force, quiet, pretty;
+	int ch, format;
+	bool all, force, quiet, pretty, raw;
 
 	all = force = quiet = pretty = false;
+	format = PWOUT_NONE;
 
 	struct group fakegroup = {
 		"nogroup",
@@ -310,10 +511,15 @@ pw_group_show(int argc, char **argv, char *arg1)
 			id = pw_checkgid(arg1);
 		else
 			name = arg1;
+		pw_addkey(&keys, arg1);
 	}
 
-	while ((ch = getopt(argc, argv, "C:qn:g:FPa")) != -1) {
+	while ((ch = getopt(argc, argv, "C:qn:g:FPao:w:s:l:")) != -1 ||
+	    optind < argc) {
 		switch (ch) {
+		case -1:
+			pw_addkey(&keys, argv[optind++]);
+			break;
 		case 'C':
 			/* ignore compatibility */
 			break;
@@ -322,9 +528,11 @@ pw_group_show(int argc, char **argv, char *arg1)
 			break;
 		case 'n':
 			name = optarg;
+			pw_addkey(&keys, optarg);
 			break;
 		case 'g':
 			id = pw_checkgid(optarg);
+			pw_addkey(&keys, optarg);
 			break;
 		case 'F':
 			force = true;
@@ -335,30 +543,79 @@ pw_group_show(int argc, char **argv, char *arg1)
 		case 'a':
 			all = true;
 			break;
+		case 'o':
+			if ((format = pw_outformat(optarg)) == -1)
+				errx(EX_USAGE, "unknown output format `%s'",
+				    optarg);
+			break;
+		case 'w':
+		case 's':
+		case 'l':
+			if (q == NULL)
+				q = pw_query_new(W_GROUP);
+			if (ch == 'w')
+				pw_query_where(q, optarg);
+			else if (ch == 's')
+				pw_query_sort(q, optarg);
+			else
+				pw_query_limit(q, optarg);
+			break;
 		default:
 			usage();
 		}
 	}
-	argc -= optind;
-	argv += optind;
-	if (argc > 0)
-		usage();
+	if (format != PWOUT_NONE && pretty)
+		errx(EX_USAGE, "-o cannot be combined with -P");
+	if (q != NULL) {
+		if (keys != NULL)
+			errx(EX_USAGE, "-w, -s and -l select from all groups");
+		all = true;
+	}
 
 	if (quiet)
 		freopen(_PATH_DEVNULL, "w", stderr);
 
 	if (all) {
-		SETGRENT();
-		while ((grp = GETGRENT()) != NULL)
-			print_group(grp, pretty);
-		ENDGRENT();
+		if (format != PWOUT_NONE)
+			pw_outbegin(format, W_GROUP);
+		/*
+		 * Plain records of the file itself, with nothing pending
+		 * over it, print as they are
+		 */
+		raw = format == PWOUT_NONE && !pretty &&
+		    PWALTDIR() != PWF_REGULAR && pw_txclean(PWTX_GR);
+		if (raw)
+			fflush(stdout);
+		if (q != NULL)
+			show_query(q, format, pretty);
+		else if (!raw || !vdumpgrent(STDOUT_FILENO)) {
+			SETGRENT();
+			while ((grp = GETGRENT()) != NULL)
+				show_group(grp, format, pretty);
+			ENDGRENT();
+		}
+		if (format != PWOUT_NONE)
+			pw_outend();
+		pw_query_free(q);
+		sl_free(keys, 1);
 		return (EXIT_SUCCESS);
 	}
 
+	if (keys != NULL && (keys->sl_cur != 1 || (id < 0 && name == NULL)))
+		return (show_keys(keys, format, pretty,
+		    force ? &fakegroup : NULL));
+	sl_free(keys, 1);
 	grp = getgroup(name, id, !force);
 	if (grp == NULL)
 		grp = &fakegroup;
 
+	if (format != PWOUT_NONE) {
+		pw_outbegin(format, W_GROUP);
+		show_group(grp, format, pretty);
+		pw_outend();
+		return (EXIT_SUCCESS);
+	}
+
 	return (print_group(grp, pretty));
 }
 
@@ -29,26 +29,23 @@
 #include <sys/types.h>
 
 #include <err.h>
+#include <errno.h>
 #include <pwd.h>
 #include <libutil.h>
 #include <unistd.h>
 
 #include "pw.h"
 
-static int
-pw_nisupdate(const char * path, struct passwd * pwd, char const * user)
+/*
+ * Apply the changes made to the NIS passwd file path in a transaction,
+ * in one pass like master.passwd.  Failures are only warned of.
+ */
+int
+nis_commit(const char *path, struct pwtxent *ent, size_t n)
 {
-	int pfd, tfd;
-	struct passwd *pw = NULL;
-	struct passwd *old_pw = NULL;
+	int pfd, tfd, rc;
 
 	printf("===> %s\n", path);
-	if (pwd != NULL)
-		pw = pw_dup(pwd);
-
-	if (user != NULL)
-		old_pw = GETPWNAM(user);
-
 	if (pw_init(NULL, path))
 		err(1,"pw_init()");
 	if ((pfd = pw_lock()) == -1) {
@@ -59,19 +56,18 @@ pw_nisupdate(const char * path, struct passwd * pwd, char const * user)
 		pw_fini();
 		err(1, "pw_tmp()");
 	}
-	if (pw_copy(pfd, tfd, pw, old_pw) == -1) {
-		pw_fini();
+	if ((rc = pw_txrewrite(PWTX_NIS, pfd, tfd, ent, n, NULL)) != 0) {
 		close(tfd);
-		err(1, "pw_copy()");
+		pw_fini();
+		errno = rc;
+		warn("NIS passwd update");
+		return (-1);
 	}
-	fsync(tfd);
 	close(tfd);
 	if (chmod(pw_tempname(), 0644) == -1)
 		err(1, "chmod()");
 	if (rename(pw_tempname(), path) == -1)
 		err(1, "rename()");
-
-	free(pw);
 	pw_fini();
 
 	return (0);
@@ -80,17 +76,17 @@ pw_nisupdate(const char * path, struct passwd * pwd, char const * user)
 int
 addnispwent(const char *path, struct passwd * pwd)
 {
-	return pw_nisupdate(path, pwd, NULL);
+	return (pw_txnis(path, NULL, pwd));
 }
 
 int
 chgnispwent(const char *path, char const * login, struct passwd * pwd)
 {
-	return pw_nisupdate(path, pwd, login);
+	return (pw_txnis(path, login, pwd));
 }
 
 int
 delnispwent(const char *path, const char *login)
 {
-	return pw_nisupdate(path, NULL, login);
+	return (pw_txnis(path, login, NULL));
 }
@@ -0,0 +1,310 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (C) 1996
+ *	David L. Nugent.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DAVID L. NUGENT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL DAVID L. NUGENT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "pw.h"
+
+/*
+ * Machine-readable output of usershow and groupshow: JSON Lines, one
+ * object per record, or CSV with a header line.  Records are formatted
+ * straight into one buffer, written out as it fills.
+ */
+
+#define OUT_BUFSIZE	(64 * 1024)
+
+static struct {
+	int		 format;
+	bool		 first;		/* no field on this line yet */
+	size_t		 len;
+	char		 buf[OUT_BUFSIZE];
+} out;
+
+static const char *userfields[] = {
+	"name", "passwd", "uid", "gid", "class", "change", "expire", "gecos",
+	"dir", "shell", "group", "groups", NULL
+};
+static const char *groupfields[] = {
+	"name", "passwd", "gid", "members", NULL
+};
+
+int
+pw_outformat(const char *name)
+{
+	if (strcmp(name, "jsonl") == 0 || strcmp(name, "json") == 0)
+		return (PWOUT_JSONL);
+	if (strcmp(name, "csv") == 0)
+		return (PWOUT_CSV);
+	return (-1);
+}
+
+static void
+out_write(const char *p, size_t len)
+{
+	ssize_t w;
+
+	while (len > 0) {
+		if ((w = write(STDOUT_FILENO, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EX_IOERR, "stdout");
+		}
+		p += w;
+		len -= w;
+	}
+}
+
+static void
+out_put(const char *p, size_t len)
+{
+	if (out.len + len > sizeof(out.buf)) {
+		out_write(out.buf, out.len);
+		out.len = 0;
+		if (len > sizeof(out.buf)) {
+			out_write(p, len);
+			return;
+		}
+	}
+	memcpy(out.buf + out.len, p, len);
+	out.len += len;
+}
+
+static void
+out_putc(char c)
+{
+	if (out.len == sizeof(out.buf)) {
+		out_write(out.buf, out.len);
+		out.len = 0;
+	}
+	out.buf[out.len++] = c;
+}
+
+/*
+ * The body of a quoted string: escaped for JSON, or with quotes doubled
+ * for CSV.
+ */
+static void
+out_escaped(const char *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char *run;
+
+	for (run = s; *s != '\0'; s++) {
+		if (out.format == PWOUT_CSV) {
+			if (*s != '"')
+				continue;
+			out_put(run, s - run + 1);
+			run = s;
+			continue;
+		}
+		if (*s != '"' && *s != '\\' && (unsigned char)*s >= 0x20)
+			continue;
+		out_put(run, s - run);
+		run = s + 1;
+		out_putc('\\');
+		switch (*s) {
+		case '\n':
+			out_putc('n');
+			break;
+		case '\t':
+			out_putc('t');
+			break;
+		case '\r':
+			out_putc('r');
+			break;
+		case '"':
+		case '\\':
+			out_putc(*s);
+			break;
+		default:
+			out_put("u00", 3);
+			out_putc(hex[(unsigned char)*s >> 4]);
+			out_putc(hex[*s & 0xf]);
+		}
+	}
+	out_put(run, s - run);
+}
+
+static void
+out_quoted(const char *s)
+{
+	out_putc('"');
+	out_escaped(s);
+	out_putc('"');
+}
+
+static void
+out_key(const char *key)
+{
+	if (out.format == PWOUT_JSONL) {
+		out_putc(out.first ? '{' : ',');
+		out_putc('"');
+		out_put(key, strlen(key));
+		out_put("\":", 2);
+	} else if (!out.first)
+		out_putc(',');
+	out.first = false;
+}
+
+static void
+out_str(const char *key, const char *s)
+{
+	out_key(key);
+	if (s == NULL) {
+		if (out.format == PWOUT_JSONL)
+			out_put("null", 4);
+	} else if (out.format == PWOUT_JSONL || strpbrk(s, ",\"\r\n") != NULL)
+		out_quoted(s);
+	else
+		out_put(s, strlen(s));
+}
+
+static void
+out_num(const char *key, intmax_t n)
+{
+	char buf[24], *p;
+	uintmax_t u;
+
+	out_key(key);
+	p = buf + sizeof(buf);
+	u = n < 0 ? -(uintmax_t)n : (uintmax_t)n;
+	do
+		*--p = '0' + u % 10;
+	while ((u /= 10) != 0);
+	if (n < 0)
+		*--p = '-';
+	out_put(p, buf + sizeof(buf) - p);
+}
+
+/*
+ * A list of n names: a JSON array, or one CSV field of them separated
+ * by commas.
+ */
+static void
+out_list(const char *key, char * const *v, size_t n)
+{
+	size_t i;
+
+	out_key(key);
+	if (out.format == PWOUT_JSONL) {
+		out_putc('[');
+		for (i = 0; i < n; i++) {
+			if (i > 0)
+				out_putc(',');
+			out_quoted(v[i]);
+		}
+		out_putc(']');
+		return;
+	}
+	if (n == 0)
+		return;
+	out_putc('"');
+	for (i = 0; i < n; i++) {
+		if (i > 0)
+			out_putc(',');
+		out_escaped(v[i]);
+	}
+	out_putc('"');
+}
+
+static void
+out_eol(void)
+{
+	if (out.format == PWOUT_JSONL)
+		out_putc('}');
+	out_putc('\n');
+	out.first = true;
+}
+
+/*
+ * Start output in format of users or groups, as which says.
+ */
+void
+pw_outbegin(int format, int which)
+{
+	const char **f;
+
+	fflush(stdout);
+	out.format = format;
+	out.len = 0;
+	out.first = true;
+	if (format != PWOUT_CSV)
+		return;
+	for (f = which == W_USER ? userfields : groupfields; *f != NULL; f++)
+		out_str(*f, *f);
+	out_eol();
+}
+
+/*
+ * A user, with the name of its primary group (NULL if it has none)
+ * and the groups it is a member of (NULL for none).
+ */
+void
+pw_outuser(const struct passwd *pwd, const char *group, StringList *groups)
+{
+	out_str("name", pwd->pw_name);
+	out_str("passwd", pwd->pw_passwd);
+	out_num("uid", PW_UID_ARG(pwd->pw_uid));
+	out_num("gid", PW_GID_ARG(pwd->pw_gid));
+	out_str("class", pwd->pw_class);
+	out_num("change", pwd->pw_change);
+	out_num("expire", pwd->pw_expire);
+	out_str("gecos", pwd->pw_gecos);
+	out_str("dir", pwd->pw_dir);
+	out_str("shell", pwd->pw_shell);
+	out_str("group", group);
+	out_list("groups", groups != NULL ? groups->sl_str : NULL,
+	    groups != NULL ? groups->sl_cur : 0);
+	out_eol();
+}
+
+void
+pw_outgroup(const struct group *grp)
+{
+	size_t n;
+
+	n = 0;
+	while (grp->gr_mem != NULL && grp->gr_mem[n] != NULL)
+		n++;
+	out_str("name", grp->gr_name);
+	out_str("passwd", grp->gr_passwd);
+	out_num("gid", PW_GID_ARG(grp->gr_gid));
+	out_list("members", grp->gr_mem, n);
+	out_eol();
+}
+
+void
+pw_outend(void)
+{
+	out_write(out.buf, out.len);
+	out.len = 0;
+}
@@ -0,0 +1,560 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (C) 1996
+ *	David L. Nugent.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DAVID L. NUGENT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL DAVID L. NUGENT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <err.h>
+#include <fnmatch.h>
+#include <libutil.h>
+#include <limits.h>
+#include <string.h>
+#include <sysexits.h>
+
+#include "pw.h"
+#include "psdate.h"
+
+/*
+ * Filters, sort order and limit for usershow -a and groupshow -a.
+ * Records are matched as the database is read; only those that pass
+ * are held, and with a limit no more of them than that.
+ */
+
+enum qtype { QT_STR, QT_ID, QT_DATE, QT_LIST };
+enum qop { Q_EQ, Q_NE, Q_LT, Q_LE, Q_GT, Q_GE };
+enum qfield {
+	QF_NAME, QF_UID, QF_GID, QF_CLASS, QF_GECOS, QF_DIR, QF_SHELL,
+	QF_CHANGE, QF_EXPIRE, QF_GROUP, QF_MEMBER
+};
+
+static const struct {
+	const char	*name;
+	enum qfield	 field;
+	enum qtype	 type;
+	int		 which;		/* W_USER, W_GROUP or W_NUM for both */
+} qfields[] = {
+	{ "name",	QF_NAME,	QT_STR,		W_NUM },
+	{ "uid",	QF_UID,		QT_ID,		W_USER },
+	{ "gid",	QF_GID,		QT_ID,		W_NUM },
+	{ "class",	QF_CLASS,	QT_STR,		W_USER },
+	{ "gecos",	QF_GECOS,	QT_STR,		W_USER },
+	{ "dir",	QF_DIR,		QT_STR,		W_USER },
+	{ "shell",	QF_SHELL,	QT_STR,		W_USER },
+	{ "change",	QF_CHANGE,	QT_DATE,	W_USER },
+	{ "expire",	QF_EXPIRE,	QT_DATE,	W_USER },
+	{ "group",	QF_GROUP,	QT_LIST,	W_USER },
+	{ "member",	QF_MEMBER,	QT_LIST,	W_GROUP },
+};
+
+static const struct {
+	const char	*op;
+	enum qop	 qop;
+} qops[] = {		/* longest first */
+	{ "!=", Q_NE }, { "<=", Q_LE }, { ">=", Q_GE },
+	{ "=", Q_EQ }, { "<", Q_LT }, { ">", Q_GT },
+};
+
+#define QNFIELDS	(sizeof(qfields) / sizeof(qfields[0]))
+#define QNOPS		(sizeof(qops) / sizeof(qops[0]))
+
+struct pwpred {
+	enum qfield	 field;
+	enum qtype	 type;
+	enum qop	 op;
+	const char	*str;
+	intmax_t	 num;
+};
+
+struct qheld {
+	void		*rec;
+	size_t		 seq;
+};
+
+struct pwquery {
+	int		 which;
+	struct pwpred	*preds;
+	size_t		 npreds;
+	enum qfield	 sort;
+	bool		 sorted;
+	size_t		 limit;		/* 0 for none */
+	size_t		 taken;
+	struct qheld	*held;		/* a heap while a limit applies */
+	size_t		 nheld, maxheld;
+	size_t		 next;
+	void		*last;		/* handed out by pw_query_next() */
+};
+
+struct pwquery *
+pw_query_new(int which)
+{
+	struct pwquery *q;
+
+	if ((q = calloc(1, sizeof(*q))) == NULL)
+		err(EX_OSERR, "calloc()");
+	q->which = which;
+	return (q);
+}
+
+/*
+ * Add a condition of the form field op value, all of which a record
+ * must meet.  Strings compare equal as shell patterns; dates are
+ * anything -e takes.
+ */
+void
+pw_query_where(struct pwquery *q, const char *expr)
+{
+	struct pwpred	*p;
+	const char	*errstr, *v;
+	size_t		 i, len;
+
+	len = strcspn(expr, "!<>=");
+	for (i = 0; i < QNFIELDS; i++)
+		if (strlen(qfields[i].name) == len &&
+		    strncmp(qfields[i].name, expr, len) == 0 &&
+		    (qfields[i].which == W_NUM || qfields[i].which == q->which))
+			break;
+	if (i == QNFIELDS)
+		errx(EX_USAGE, "unknown field in `%s'", expr);
+	if ((p = reallocarray(q->preds, q->npreds + 1,
+	    sizeof(*q->preds))) == NULL)
+		err(EX_OSERR, "reallocarray()");
+	q->preds = p;
+	p = &q->preds[q->npreds++];
+	p->field = qfields[i].field;
+	p->type = qfields[i].type;
+
+	v = expr + len;
+	for (i = 0; i < QNOPS; i++)
+		if (strncmp(v, qops[i].op, strlen(qops[i].op)) == 0)
+			break;
+	if (i == QNOPS)
+		errx(EX_USAGE, "no comparison in `%s'", expr);
+	p->op = qops[i].qop;
+	v += strlen(qops[i].op);
+	if (p->type == QT_LIST && p->op != Q_EQ && p->op != Q_NE)
+		errx(EX_USAGE, "only = and != apply to `%.*s'", (int)len, expr);
+
+	p->str = v;
+	switch (p->type) {
+	case QT_ID:
+		p->num = strtounum(v, 0, UID_MAX, &errstr);
+		if (errstr != NULL)
+			errx(EX_USAGE, "bad id `%s': %s", v, errstr);
+		break;
+	case QT_DATE:
+		p->num = parse_date(0, v);
+		break;
+	default:
+		break;
+	}
+}
+
+void
+pw_query_sort(struct pwquery *q, const char *key)
+{
+	if (strcmp(key, "name") == 0)
+		q->sort = QF_NAME;
+	else if (strcmp(key, q->which == W_USER ? "uid" : "gid") == 0)
+		q->sort = q->which == W_USER ? QF_UID : QF_GID;
+	else
+		errx(EX_USAGE, "cannot sort by `%s'", key);
+	q->sorted = true;
+}
+
+void
+pw_query_limit(struct pwquery *q, const char *count)
+{
+	const char *errstr;
+
+	q->limit = strtonum(count, 1, INT_MAX, &errstr);
+	if (errstr != NULL)
+		errx(EX_USAGE, "bad limit `%s': %s", count, errstr);
+}
+
+/*
+ * Whether matching users needs their groups
+ */
+bool
+pw_query_needgroups(const struct pwquery *q)
+{
+	size_t i;
+
+	for (i = 0; i < q->npreds; i++)
+		if (q->preds[i].field == QF_GROUP)
+			return (true);
+	return (false);
+}
+
+/*
+ * A name, or an id, that every match must have, so that the caller can
+ * look it up rather than read everything.  Returns the name, or NULL
+ * with *id set, or -1 if there is neither.
+ */
+const char *
+pw_query_key(const struct pwquery *q, intmax_t *id)
+{
+	const struct pwpred *p;
+	size_t i;
+
+	*id = -1;
+	for (i = 0; i < q->npreds; i++) {
+		p = &q->preds[i];
+		if (p->op != Q_EQ)
+			continue;
+		if (p->field == QF_NAME && strpbrk(p->str, "*?[\\") == NULL)
+			return (p->str);
+		if (p->field == (q->which == W_USER ? QF_UID : QF_GID))
+			*id = p->num;
+	}
+	return (NULL);
+}
+
+static bool
+qcompare(const struct pwpred *p, int c)
+{
+	switch (p->op) {
+	case Q_EQ:
+		return (c == 0);
+	case Q_NE:
+		return (c != 0);
+	case Q_LT:
+		return (c < 0);
+	case Q_LE:
+		return (c <= 0);
+	case Q_GT:
+		return (c > 0);
+	case Q_GE:
+		return (c >= 0);
+	}
+	return (false);
+}
+
+static bool
+qmatchstr(const struct pwpred *p, const char *s)
+{
+	if (s == NULL)
+		s = "";
+	if (p->op == Q_EQ || p->op == Q_NE)
+		return (qcompare(p, fnmatch(p->str, s, 0) == 0 ? 0 : 1));
+	return (qcompare(p, strcmp(s, p->str)));
+}
+
+static bool
+qmatchnum(const struct pwpred *p, intmax_t v)
+{
+	/* A date of 0 is never, later than any other */
+	if (p->type == QT_DATE && v == 0 && p->num != 0)
+		v = INTMAX_MAX;
+	return (qcompare(p, v < p->num ? -1 : v > p->num));
+}
+
+/*
+ * Whether any of n names (or the one in first) match; for != whether
+ * none does.
+ */
+static bool
+qmatchlist(const struct pwpred *p, const char *first, char * const *v,
+    size_t n)
+{
+	size_t i;
+	bool any;
+
+	any = first != NULL && fnmatch(p->str, first, 0) == 0;
+	for (i = 0; !any && i < n; i++)
+		any = fnmatch(p->str, v[i], 0) == 0;
+	return (p->op == Q_EQ ? any : !any);
+}
+
+/*
+ * Whether a user meets the conditions; group is the name of its primary
+ * group and groups those it is a member of, needed only if
+ * pw_query_needgroups() says so.
+ */
+bool
+pw_query_user(const struct pwquery *q, const struct passwd *pwd,
+    const char *group, StringList *groups)
+{
+	const struct pwpred *p;
+	size_t i;
+	bool ok;
+
+	for (i = 0, ok = true; ok && i < q->npreds; i++) {
+		p = &q->preds[i];
+		switch (p->field) {
+		case QF_NAME:
+			ok = qmatchstr(p, pwd->pw_name);
+			break;
+		case QF_UID:
+			ok = qmatchnum(p, pwd->pw_uid);
+			break;
+		case QF_GID:
+			ok = qmatchnum(p, pwd->pw_gid);
+			break;
+		case QF_CLASS:
+			ok = qmatchstr(p, pwd->pw_class);
+			break;
+		case QF_GECOS:
+			ok = qmatchstr(p, pwd->pw_gecos);
+			break;
+		case QF_DIR:
+			ok = qmatchstr(p, pwd->pw_dir);
+			break;
+		case QF_SHELL:
+			ok = qmatchstr(p, pwd->pw_shell);
+			break;
+		case QF_CHANGE:
+			ok = qmatchnum(p, pwd->pw_change);
+			break;
+		case QF_EXPIRE:
+			ok = qmatchnum(p, pwd->pw_expire);
+			break;
+		case QF_GROUP:
+			ok = qmatchlist(p, group,
+			    groups != NULL ? groups->sl_str : NULL,
+			    groups != NULL ? groups->sl_cur : 0);
+			break;
+		default:
+			break;
+		}
+	}
+	return (ok);
+}
+
+bool
+pw_query_group(const struct pwquery *q, const struct group *grp)
+{
+	const struct pwpred *p;
+	size_t i, n;
+	bool ok;
+
+	for (i = 0, ok = true; ok && i < q->npreds; i++) {
+		p = &q->preds[i];
+		switch (p->field) {
+		case QF_NAME:
+			ok = qmatchstr(p, grp->gr_name);
+			break;
+		case QF_GID:
+			ok = qmatchnum(p, grp->gr_gid);
+			break;
+		case QF_MEMBER:
+			n = 0;
+			while (grp->gr_mem != NULL && grp->gr_mem[n] != NULL)
+				n++;
+			ok = qmatchlist(p, NULL, grp->gr_mem, n);
+			break;
+		default:
+			break;
+		}
+	}
+	return (ok);
+}
+
+/*
+ * Sort order of held records, ties kept in file order
+ */
+static int
+qheldcmp(const struct pwquery *q, const struct qheld *a,
+    const struct qheld *b)
+{
+	const struct passwd *pa, *pb;
+	const struct group *ga, *gb;
+	uintmax_t ia, ib;
+	int c;
+
+	if (q->which == W_USER) {
+		pa = a->rec;
+		pb = b->rec;
+		if (q->sort == QF_NAME)
+			c = strcmp(pa->pw_name, pb->pw_name);
+		else {
+			ia = pa->pw_uid;
+			ib = pb->pw_uid;
+			c = ia < ib ? -1 : ia > ib;
+		}
+	} else {
+		ga = a->rec;
+		gb = b->rec;
+		if (q->sort == QF_NAME)
+			c = strcmp(ga->gr_name, gb->gr_name);
+		else {
+			ia = ga->gr_gid;
+			ib = gb->gr_gid;
+			c = ia < ib ? -1 : ia > ib;
+		}
+	}
+	if (c == 0)
+		c = a->seq < b->seq ? -1 : a->seq > b->seq;
+	return (c);
+}
+
+static const struct pwquery *qsorting;
+
+static int
+qsortcmp(const void *a, const void *b)
+{
+	return (qheldcmp(qsorting, a, b));
+}
+
+/*
+ * Restore the heap (last in order at the top) below slot i
+ */
+static void
+qsiftdown(struct pwquery *q, size_t i)
+{
+	struct qheld tmp;
+	size_t c;
+
+	while ((c = 2 * i + 1) < q->nheld) {
+		if (c + 1 < q->nheld &&
+		    qheldcmp(q, &q->held[c + 1], &q->held[c]) > 0)
+			c++;
+		if (qheldcmp(q, &q->held[c], &q->held[i]) <= 0)
+			break;
+		tmp = q->held[i];
+		q->held[i] = q->held[c];
+		q->held[c] = tmp;
+		i = c;
+	}
+}
+
+static void
+qsiftup(struct pwquery *q, size_t i)
+{
+	struct qheld tmp;
+	size_t parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (qheldcmp(q, &q->held[i], &q->held[parent]) <= 0)
+			break;
+		tmp = q->held[i];
+		q->held[i] = q->held[parent];
+		q->held[parent] = tmp;
+		i = parent;
+	}
+}
+
+static void *
+qdup(const struct pwquery *q, const void *rec)
+{
+	void *p;
+
+	p = q->which == W_USER ? (void *)pw_dup(rec) : (void *)gr_dup(rec);
+	if (p == NULL)
+		err(EX_OSERR, "%s", q->which == W_USER ? "pw_dup()" :
+		    "gr_dup()");
+	return (p);
+}
+
+/*
+ * Take a matching record.  Returns true if it is to be printed now;
+ * when sorting it is held (a copy of it, rec may be reused) instead.
+ */
+bool
+pw_query_take(struct pwquery *q, const void *rec)
+{
+	struct qheld h, *p;
+	size_t n;
+
+	if (!q->sorted) {
+		q->taken++;
+		return (true);
+	}
+	h.rec = NULL;
+	h.seq = q->taken++;
+	if (q->limit > 0 && q->nheld == q->limit) {
+		/*
+		 * Full: it displaces the last held record if before it.
+		 * The comparison needs only the sort key, so look at rec
+		 * itself before copying it.
+		 */
+		h.rec = (void *)(uintptr_t)rec;
+		if (qheldcmp(q, &h, &q->held[0]) >= 0)
+			return (false);
+		free(q->held[0].rec);
+		q->held[0].rec = qdup(q, rec);
+		q->held[0].seq = h.seq;
+		qsiftdown(q, 0);
+		return (false);
+	}
+	if (q->nheld == q->maxheld) {
+		n = q->maxheld ? q->maxheld * 2 : 64;
+		if (q->limit > 0 && n > q->limit)
+			n = q->limit;
+		if ((p = reallocarray(q->held, n, sizeof(*p))) == NULL)
+			err(EX_OSERR, "reallocarray()");
+		q->held = p;
+		q->maxheld = n;
+	}
+	h.rec = qdup(q, rec);
+	q->held[q->nheld++] = h;
+	if (q->limit > 0)
+		qsiftup(q, q->nheld - 1);
+	return (false);
+}
+
+/*
+ * Whether the reading can stop: the limit is reached, and nothing later
+ * can displace what was printed.
+ */
+bool
+pw_query_done(const struct pwquery *q)
+{
+	return (!q->sorted && q->limit > 0 && q->taken >= q->limit);
+}
+
+/*
+ * Once the reading is done, the held records in order, then NULL
+ */
+void *
+pw_query_next(struct pwquery *q)
+{
+	free(q->last);
+	q->last = NULL;
+	if (q->next == 0 && q->nheld > 1) {
+		qsorting = q;
+		qsort(q->held, q->nheld, sizeof(*q->held), qsortcmp);
+	}
+	if (q->next == q->nheld)
+		return (NULL);
+	q->last = q->held[q->next].rec;
+	q->held[q->next++].rec = NULL;
+	return (q->last);
+}
+
+void
+pw_query_free(struct pwquery *q)
+{
+	size_t i;
+
+	if (q == NULL)
+		return;
+	for (i = 0; i < q->nheld; i++)
+		free(q->held[i].rec);
+	free(q->held);
+	free(q->last);
+	free(q->preds);
+	free(q);
+}
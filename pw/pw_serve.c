@@ -0,0 +1,471 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (C) 1996
+ *	David L. Nugent.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DAVID L. NUGENT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL DAVID L. NUGENT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "pw.h"
+
+/*
+ * pw serve runs the commands of other pw processes, sent to it over
+ * pw.socket in the directory of the files it manages.  A request is a
+ * header (the length of what follows, and the client's umask), then the
+ * command's arguments, each NUL-terminated; the client's standard input,
+ * output and error and its working directory go with the header, and
+ * the command is run with them as its own.  Commands that arrive while
+ * others are being run are committed together, and each client is sent
+ * its exit status once its command's changes are committed.
+ */
+
+#define SERVE_MAXREQ	(64 * 1024)
+#define SERVE_TIMEOUT	5	/* seconds a client has to send a request */
+#define SERVE_NFD	4	/* stdin, stdout, stderr, working directory */
+#define SERVE_NISQUIET	10	/* idle seconds before rebuilding NIS maps */
+
+struct servehdr {
+	uint32_t	len;
+	uint32_t	umask;
+};
+
+/* Clients whose commands await the group commit, with their status */
+struct serveclient {
+	int		fd;
+	int		rc;
+};
+
+static struct serveclient *clients;
+static size_t	nclients, clientcap;
+static jmp_buf	servejmp;
+static int	savedfd[SERVE_NFD];
+static volatile sig_atomic_t servestop;
+
+static int
+serve_addr(struct sockaddr_un *sun)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (strlcpy(sun->sun_path, getpwpath(_PWSOCKET),
+	    sizeof(sun->sun_path)) >= sizeof(sun->sun_path)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Read a request from s: its arguments, as argv[1] onwards, and the
+ * descriptors sent with it.  Returns NULL if the client does not
+ * send a well-formed request in time.
+ */
+static char **
+serve_read(int s, int *argcp, int fds[SERVE_NFD], mode_t *umaskp)
+{
+	struct servehdr	 hdr;
+	struct msghdr	 msg;
+	struct iovec	 iov;
+	struct cmsghdr	*cm;
+	union {
+		struct cmsghdr	hdr;
+		char		buf[CMSG_SPACE(SERVE_NFD * sizeof(int))];
+	} cmsgbuf;
+	char		*buf, *p, **argv;
+	size_t		 nfd;
+	int		 argc, i;
+
+	for (i = 0; i < SERVE_NFD; i++)
+		fds[i] = -1;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &hdr;
+	iov.iov_len = sizeof(hdr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
+	if (recvmsg(s, &msg, MSG_WAITALL) != sizeof(hdr))
+		return (NULL);
+	if ((cm = CMSG_FIRSTHDR(&msg)) != NULL &&
+	    cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+		nfd = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cm), MIN(nfd, SERVE_NFD) * sizeof(int));
+		if (nfd != SERVE_NFD)
+			goto bad;
+	} else
+		goto bad;
+	if (hdr.len == 0 || hdr.len > SERVE_MAXREQ)
+		goto bad;
+	if ((buf = malloc(hdr.len)) == NULL)
+		err(EX_OSERR, "malloc()");
+	if (recv(s, buf, hdr.len, MSG_WAITALL) != (ssize_t)hdr.len ||
+	    buf[hdr.len - 1] != '\0') {
+		free(buf);
+		goto bad;
+	}
+
+	argc = 1;
+	for (p = buf; p < buf + hdr.len; p += strlen(p) + 1)
+		argc++;
+	if ((argv = calloc(argc + 1, sizeof(*argv))) == NULL)
+		err(EX_OSERR, "calloc()");
+	argv[0] = "pw";
+	for (i = 1, p = buf; i < argc; p += strlen(p) + 1)
+		argv[i++] = p;
+	*argcp = argc;
+	*umaskp = hdr.umask & 0777;
+	return (argv);
+
+bad:
+	for (i = 0; i < SERVE_NFD; i++)
+		if (fds[i] != -1)
+			close(fds[i]);
+	return (NULL);
+}
+
+/*
+ * Run the command sent on s with the client's descriptors in place of
+ * our own.  Returns its exit status, or -1 if there was no request.
+ */
+static int
+serve_run(int s, const struct pwconf *saved)
+{
+	char	**argv;
+	uid_t	  euid;
+	gid_t	  egid;
+	mode_t	  mask, omask;
+	int	  fds[SERVE_NFD], argc, rc, i;
+
+	if ((argv = serve_read(s, &argc, fds, &mask)) == NULL)
+		return (-1);
+	if (getpeereid(s, &euid, &egid) == -1 ||
+	    (euid != 0 && euid != geteuid())) {
+		dprintf(fds[2], "pw: %s\n", strerror(EPERM));
+		rc = EX_NOPERM;
+	} else {
+		fflush(stdout);
+		fflush(stderr);
+		for (i = 0; i < 3; i++)
+			dup2(fds[i], i);
+		if (fchdir(fds[3]) == -1)
+			err(EX_OSERR, "fchdir()");
+		omask = umask(mask);
+		conf = *saved;
+		rc = pw_runcmd(argc, argv);
+		fflush(stdout);
+		fflush(stderr);
+		umask(omask);
+		for (i = 0; i < 3; i++)
+			dup2(savedfd[i], i);
+		if (fchdir(savedfd[3]) == -1)
+			err(EX_OSERR, "fchdir()");
+		clearerr(stdout);
+		clearerr(stderr);
+	}
+	for (i = 0; i < SERVE_NFD; i++)
+		close(fds[i]);
+	/*
+	 * What a command leaves pending is copied, and conf is reset
+	 * before the next, so nothing points into the request any more
+	 */
+	free(argv[1]);
+	free(argv);
+	return (rc);
+}
+
+/*
+ * err(3) exit hook while a group is committed: fail the group, not the
+ * server.
+ */
+static void
+serve_fail(int eval)
+{
+	longjmp(servejmp, 1);
+}
+
+/*
+ * Commit the changes of the commands run since mark and send each
+ * client its status.
+ */
+static void
+serve_commit(size_t mark)
+{
+	int32_t	status;
+	size_t	i;
+	int	rc;
+
+	if (setjmp(servejmp) == 0) {
+		err_set_exit(serve_fail);
+		if ((rc = pw_txcommit()) == -1) {
+			warn("update");
+			rc = EX_IOERR;
+		}
+	} else {
+		pw_abandon();
+		rc = EX_IOERR;
+	}
+	err_set_exit(NULL);
+	if (rc != 0)
+		pw_txrollback(mark);
+	for (i = 0; i < nclients; i++) {
+		status = clients[i].rc != 0 ? clients[i].rc : rc;
+		write(clients[i].fd, &status, sizeof(status));
+		close(clients[i].fd);
+	}
+	nclients = 0;
+}
+
+/*
+ * Rebuild the NIS maps, if needed, without stopping on failure.
+ */
+static void
+serve_nis(void)
+{
+	if (setjmp(servejmp) == 0) {
+		err_set_exit(serve_fail);
+		nis_flush();
+	} else
+		pw_abandon();
+	err_set_exit(NULL);
+}
+
+static void
+serve_stop(int sig)
+{
+	servestop = 1;
+}
+
+/*
+ * Serve requests until told to stop, committing the commands run since
+ * the last commit whenever there are no more waiting, or after every
+ * `every' of them.  NIS maps are rebuilt once no request has come for
+ * SERVE_NISQUIET seconds.
+ */
+int
+pw_serve(int every)
+{
+	struct sockaddr_un sun;
+	struct pwconf	 saved;
+	struct pollfd	 pfd;
+	struct sigaction sa;
+	struct timeval	 tv;
+	size_t		 mark;
+	mode_t		 omask;
+	int		 lfd, s, rc, i, n;
+
+	if (serve_addr(&sun) == -1)
+		err(EX_USAGE, "%s", getpwpath(_PWSOCKET));
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(EX_OSERR, "socket()");
+	if (connect(s, (struct sockaddr *)&sun, SUN_LEN(&sun)) == 0)
+		errx(EX_UNAVAILABLE, "%s: already being served", sun.sun_path);
+	close(s);
+	if (unlink(sun.sun_path) == -1 && errno != ENOENT)
+		err(EX_OSERR, "%s", sun.sun_path);
+	if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(EX_OSERR, "socket()");
+	if (fcntl(lfd, F_SETFD, FD_CLOEXEC) == -1 ||
+	    fcntl(lfd, F_SETFL, O_NONBLOCK) == -1)
+		err(EX_OSERR, "fcntl()");
+	omask = umask(077);
+	if (bind(lfd, (struct sockaddr *)&sun, SUN_LEN(&sun)) == -1)
+		err(EX_OSERR, "%s", sun.sun_path);
+	umask(omask);
+	if (listen(lfd, SOMAXCONN) == -1)
+		err(EX_OSERR, "listen()");
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = serve_stop;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	for (i = 0; i < 3; i++)
+		if ((savedfd[i] = fcntl(i, F_DUPFD_CLOEXEC, 0)) == -1)
+			err(EX_OSERR, "fcntl()");
+	if ((savedfd[3] = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) ==
+	    -1)
+		err(EX_OSERR, "open(\".\")");
+	tv.tv_sec = SERVE_TIMEOUT;
+	tv.tv_usec = 0;
+
+	saved = conf;
+	pw_txbegin();
+	while (!servestop) {
+		pfd.fd = lfd;
+		pfd.events = POLLIN;
+		n = poll(&pfd, 1, nis_pending() ? SERVE_NISQUIET * 1000 : -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EX_OSERR, "poll()");
+		}
+		if (n == 0) {
+			serve_nis();
+			continue;
+		}
+		mark = pw_txsave();
+		while ((every == 0 || nclients < (size_t)every) &&
+		    (s = accept(lfd, NULL, NULL)) != -1) {
+			if (fcntl(s, F_SETFD, FD_CLOEXEC) == -1 ||
+			    fcntl(s, F_SETFL, 0) == -1 ||
+			    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv,
+			    sizeof(tv)) == -1 ||
+			    (rc = serve_run(s, &saved)) == -1) {
+				close(s);
+				continue;
+			}
+			if (nclients == clientcap) {
+				clientcap = clientcap ? clientcap * 2 : 64;
+				if ((clients = reallocarray(clients, clientcap,
+				    sizeof(*clients))) == NULL)
+					err(EX_OSERR, "reallocarray()");
+			}
+			clients[nclients].fd = s;
+			clients[nclients].rc = rc;
+			nclients++;
+		}
+		if (nclients > 0)
+			serve_commit(mark);
+	}
+	unlink(sun.sun_path);
+	close(lfd);
+	conf = saved;
+	if (pw_txend() == -1)
+		err(EX_IOERR, "update");
+	nis_flush();
+	return (EXIT_SUCCESS);
+}
+
+/*
+ * Have the pw serve for our files, if one is running, run the command
+ * cmd [name] argv[0..argc-1].  Returns its exit status, or -1 to run
+ * the command here: with no server, or with a descriptor other than
+ * standard input to read a password from.
+ */
+int
+pw_forward(const char *cmd, const char *name, int argc, char **argv)
+{
+	struct sockaddr_un sun;
+	struct servehdr	 hdr;
+	struct msghdr	 msg;
+	struct iovec	 iov[2];
+	struct cmsghdr	*cm;
+	union {
+		struct cmsghdr	hdr;
+		char		buf[CMSG_SPACE(SERVE_NFD * sizeof(int))];
+	} cmsgbuf;
+	const char	*fd;
+	char		*buf, *p;
+	size_t		 len, off;
+	ssize_t		 n;
+	int32_t		 status;
+	int		 fds[SERVE_NFD], s, i;
+
+	for (i = 0; i < argc; i++) {
+		if (argv[i][0] != '-' ||
+		    (argv[i][1] != 'h' && argv[i][1] != 'H'))
+			continue;
+		fd = argv[i][2] != '\0' ? &argv[i][2] : argv[i + 1];
+		if (fd != NULL && strcmp(fd, "0") != 0)
+			return (-1);
+	}
+	if (serve_addr(&sun) == -1 ||
+	    (s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return (-1);
+	if (connect(s, (struct sockaddr *)&sun, SUN_LEN(&sun)) == -1) {
+		close(s);
+		return (-1);
+	}
+
+	len = strlen(cmd) + 1 + (name != NULL ? strlen(name) + 1 : 0);
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	if (len > SERVE_MAXREQ) {
+		close(s);
+		return (-1);
+	}
+	if ((buf = malloc(len)) == NULL)
+		err(EX_OSERR, "malloc()");
+	p = stpcpy(buf, cmd) + 1;
+	if (name != NULL)
+		p = stpcpy(p, name) + 1;
+	for (i = 0; i < argc; i++)
+		p = stpcpy(p, argv[i]) + 1;
+
+	fds[0] = STDIN_FILENO;
+	fds[1] = STDOUT_FILENO;
+	fds[2] = STDERR_FILENO;
+	if ((fds[3] = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		err(EX_OSERR, "open(\".\")");
+	hdr.len = len;
+	hdr.umask = umask(0);
+	umask(hdr.umask);
+	memset(&msg, 0, sizeof(msg));
+	memset(&cmsgbuf, 0, sizeof(cmsgbuf));
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = len;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+	fflush(stdout);
+	fflush(stderr);
+	if ((n = sendmsg(s, &msg, 0)) == -1)
+		err(EX_UNAVAILABLE, "%s", sun.sun_path);
+	if ((size_t)n < sizeof(hdr))
+		errx(EX_UNAVAILABLE, "%s: short write", sun.sun_path);
+	/* The rest of a long request, if it did not all go at once */
+	for (off = n - sizeof(hdr); off < len; off += n)
+		if ((n = write(s, buf + off, len - off)) == -1)
+			err(EX_UNAVAILABLE, "%s", sun.sun_path);
+	close(fds[3]);
+	free(buf);
+
+	if (recv(s, &status, sizeof(status), MSG_WAITALL) != sizeof(status))
+		errx(EX_UNAVAILABLE, "%s: no reply; the command may not have "
+		    "been committed", sun.sun_path);
+	close(s);
+	return (status);
+}
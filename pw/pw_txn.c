@@ -0,0 +1,1481 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (C) 1996
+ *	David L. Nugent.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY DAVID L. NUGENT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL DAVID L. NUGENT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <libutil.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pwupd.h"
+#include "bitmap.h"
+
+/*
+ * Transactions over master.passwd and group.  Changes made through
+ * addpwent() and friends between pw_txbegin() and pw_txcommit() are
+ * kept in memory and applied together: one lock, one rewrite and one
+ * database rebuild per file.  While a transaction is open the lookup
+ * functions in PWF are routed through an overlay, so that a command
+ * sees its own pending changes.
+ *
+ * Transactions nest; only the outermost pw_txcommit() writes anything,
+ * so callers can group several commands into one commit.
+ *
+ * With conf.journal set, a commit instead appends the changes made
+ * since the last one to pw.journal and syncs it, and the overlay keeps
+ * them; the files are rewritten ("folded") once, when the outermost
+ * transaction ends.  The journal stays locked meanwhile.  Whoever next
+ * finds it unlocked and not empty replays it, skipping a file the fold
+ * had already installed, as recorded by pw_txfolding().
+ */
+
+#define TXH_CUR		0	/* by name of the pending record */
+#define TXH_KEY		1	/* by name in the file */
+#define TXH_ID		2	/* by id of the pending record */
+
+struct txlink {
+	size_t		 ent;
+	size_t		 next;		/* index + 1 of the next link, or 0 */
+};
+
+/*
+ * Pending entries are found through three chained hash tables.  Links
+ * are only ever added, so one may point at an entry that no longer
+ * matches; lookups check, and a rehash drops them.
+ */
+struct txset {
+	struct pwtxent	*ent;
+	size_t		 n, cap;
+	size_t		 iter;		/* next entry to check for additions */
+	bool		 inbase;	/* still enumerating the file */
+	size_t		 basepos;	/* records read from the file so far */
+	size_t		*head;		/* 3 tables of nbucket chains */
+	size_t		 nbucket;
+	struct txlink	*link;
+	size_t		 nlink, linkcap;
+};
+
+/*
+ * One step to undo: an entry appended, or the record an entry had
+ * before it was replaced.  Replaced records are freed on commit.
+ */
+struct txundo {
+	int		 kind;
+	size_t		 ent;
+	void		*old;
+	bool		 added;
+	size_t		 jpos;		/* journal text before the change */
+};
+
+/*
+ * Ids in use, as built by pw_uidused() or pw_gidused(), kept up to date
+ * with pending records so that later commands need not scan again.
+ */
+struct txids {
+	bool		 valid;
+	uintmax_t	 min, max;
+	struct bitmap	 bm;
+};
+
+static struct pwf txbase;
+static struct txset txsets[3];
+static struct txset txviews[2];		/* what the last fold wrote */
+static struct txids txids[3];
+static int txdepth;
+static char txnispath[MAXPATHLEN];	/* the NIS passwd file of PWTX_NIS */
+
+static struct txundo *txlog;
+static size_t txnlog, txlogcap;
+
+/* Copies of overlay records handed out by the lookup functions */
+static void **txcopy;
+static size_t txncopy, txcopycap;
+
+/* The journal, and changes not yet appended to it */
+static int txjfd = -1;
+static bool txjchecked;
+static char *txjbuf;
+static size_t txjlen, txjcap;
+static size_t txjoff;			/* bytes appended before txjbuf */
+
+static int txofd = -1;			/* the group file a fold replaces */
+
+/*
+ * Names of a change set, sorted so that each line of the file can be
+ * matched by binary search.
+ */
+struct txname {
+	const char	*name;
+	size_t		 ent;
+};
+
+/*
+ * Output of a rewrite.  Runs of unchanged lines go straight from the
+ * mapped file; new records are gathered in buf.
+ */
+struct txout {
+	int		 fd;
+	int		 error;
+	size_t		 len;
+	char		 buf[64 * 1024];
+};
+
+static struct txout txout;
+
+static const char *
+tx_name(int kind, const void *rec)
+{
+	return (kind == PWTX_GR ? ((const struct group *)rec)->gr_name :
+	    ((const struct passwd *)rec)->pw_name);
+}
+
+static uintmax_t
+tx_id(int kind, const void *rec)
+{
+	return (kind == PWTX_GR ? ((const struct group *)rec)->gr_gid :
+	    ((const struct passwd *)rec)->pw_uid);
+}
+
+static void *
+tx_dup(int kind, const void *rec)
+{
+	void *p;
+
+	p = kind == PWTX_GR ? (void *)gr_dup(rec) : (void *)pw_dup(rec);
+	if (p == NULL)
+		err(1, "%s", kind == PWTX_GR ? "gr_dup()" : "pw_dup()");
+	return (p);
+}
+
+static size_t
+tx_hashstr(const char *p)
+{
+	uint32_t h = 2166136261U;
+
+	while (*p != '\0')
+		h = (h ^ (unsigned char)*p++) * 16777619U;
+	return (h);
+}
+
+static size_t
+tx_hashid(uintmax_t id)
+{
+	uint64_t h = (uint64_t)id * 0x9e3779b97f4a7c15ULL;
+
+	return ((size_t)(h ^ (h >> 32)));
+}
+
+static size_t *
+tx_chain(struct txset *s, int which, size_t h)
+{
+	return (&s->head[which * s->nbucket + (h & (s->nbucket - 1))]);
+}
+
+static void
+tx_link(struct txset *s, int which, size_t h, size_t i)
+{
+	size_t *hp = tx_chain(s, which, h);
+
+	s->link[s->nlink].ent = i;
+	s->link[s->nlink].next = *hp;
+	*hp = ++s->nlink;
+}
+
+static void tx_rehash(int kind);
+
+static void
+tx_index(int kind, size_t i)
+{
+	struct txset *s = &txsets[kind];
+	struct pwtxent *e = &s->ent[i];
+
+	if (s->nlink + 3 > s->linkcap) {
+		tx_rehash(kind);
+		return;
+	}
+	if (e->key != NULL)
+		tx_link(s, TXH_KEY, tx_hashstr(e->key), i);
+	if (e->rec != NULL) {
+		tx_link(s, TXH_CUR, tx_hashstr(tx_name(kind, e->rec)), i);
+		tx_link(s, TXH_ID, tx_hashid(tx_id(kind, e->rec)), i);
+	}
+}
+
+static void
+tx_rehash(int kind)
+{
+	struct txset *s = &txsets[kind];
+	size_t i;
+
+	if (s->nbucket == 0)
+		s->nbucket = 64;
+	while (s->nbucket < 2 * s->n)
+		s->nbucket *= 2;
+	free(s->head);
+	if ((s->head = calloc(3 * s->nbucket, sizeof(*s->head))) == NULL)
+		err(1, "calloc()");
+	s->linkcap = 3 * s->nbucket;
+	if ((s->link = reallocarray(s->link, s->linkcap,
+	    sizeof(*s->link))) == NULL)
+		err(1, "reallocarray()");
+	s->nlink = 0;
+	for (i = 0; i < s->n; i++)
+		tx_index(kind, i);
+}
+
+/*
+ * Entry of s whose pending record is called nam.
+ */
+static struct pwtxent *
+tx_setcur(struct txset *s, int kind, const char *nam)
+{
+	struct pwtxent *e;
+	size_t l;
+
+	if (s->nbucket == 0)
+		return (NULL);
+	for (l = *tx_chain(s, TXH_CUR, tx_hashstr(nam)); l != 0;
+	    l = s->link[l - 1].next) {
+		if (s->link[l - 1].ent >= s->n)
+			continue;
+		e = &s->ent[s->link[l - 1].ent];
+		if (e->rec != NULL && strcmp(tx_name(kind, e->rec), nam) == 0)
+			return (e);
+	}
+	return (NULL);
+}
+
+/*
+ * Entry of s replacing the record called nam in the file.
+ */
+static struct pwtxent *
+tx_setkey(struct txset *s, const char *nam)
+{
+	struct pwtxent *e;
+	size_t l;
+
+	if (s->nbucket == 0)
+		return (NULL);
+	for (l = *tx_chain(s, TXH_KEY, tx_hashstr(nam)); l != 0;
+	    l = s->link[l - 1].next) {
+		if (s->link[l - 1].ent >= s->n)
+			continue;
+		e = &s->ent[s->link[l - 1].ent];
+		if (e->key != NULL && strcmp(e->key, nam) == 0)
+			return (e);
+	}
+	return (NULL);
+}
+
+/*
+ * First entry of s, in the order they were made, with a pending record
+ * numbered id.
+ */
+static struct pwtxent *
+tx_setid(struct txset *s, int kind, uintmax_t id)
+{
+	struct pwtxent *e;
+	size_t l, i, best = SIZE_MAX;
+
+	if (s->nbucket == 0)
+		return (NULL);
+	for (l = *tx_chain(s, TXH_ID, tx_hashid(id)); l != 0;
+	    l = s->link[l - 1].next) {
+		i = s->link[l - 1].ent;
+		if (i >= s->n || i >= best)
+			continue;
+		e = &s->ent[i];
+		if (e->rec != NULL && tx_id(kind, e->rec) == id)
+			best = i;
+	}
+	return (best == SIZE_MAX ? NULL : &s->ent[best]);
+}
+
+static struct pwtxent *
+tx_bycur(int kind, const char *nam)
+{
+	return (tx_setcur(&txsets[kind], kind, nam));
+}
+
+static struct pwtxent *
+tx_bykey(int kind, const char *nam)
+{
+	return (tx_setkey(&txsets[kind], nam));
+}
+
+static struct pwtxent *
+tx_byid(int kind, uintmax_t id)
+{
+	return (tx_setid(&txsets[kind], kind, id));
+}
+
+static void
+tx_logundo(int kind, size_t ent, void *old, bool added)
+{
+	if (txnlog == txlogcap) {
+		txlogcap = txlogcap ? txlogcap * 2 : 16;
+		if ((txlog = reallocarray(txlog, txlogcap,
+		    sizeof(*txlog))) == NULL)
+			err(1, "reallocarray()");
+	}
+	txlog[txnlog].kind = kind;
+	txlog[txnlog].ent = ent;
+	txlog[txnlog].old = old;
+	txlog[txnlog].added = added;
+	txlog[txnlog].jpos = txjoff + txjlen;
+	txnlog++;
+}
+
+static void
+tx_markid(int kind, const void *rec)
+{
+	struct txids *c = &txids[kind];
+	uintmax_t id;
+
+	if (rec == NULL || !c->valid)
+		return;
+	id = tx_id(kind, rec);
+	if (id >= c->min && id <= c->max)
+		bm_setbit(&c->bm, (int64_t)(id - c->min));
+}
+
+static struct pwtxent *
+tx_append(int kind, const char *key, uintmax_t oid, void *rec)
+{
+	struct txset *s = &txsets[kind];
+	struct pwtxent *e;
+
+	if (s->n == s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 16;
+		if ((s->ent = reallocarray(s->ent, s->cap,
+		    sizeof(*s->ent))) == NULL)
+			err(1, "reallocarray()");
+	}
+	e = &s->ent[s->n++];
+	e->key = NULL;
+	if (key != NULL && (e->key = strdup(key)) == NULL)
+		err(1, "strdup()");
+	e->oid = oid;
+	e->rec = rec;
+	tx_logundo(kind, s->n - 1, NULL, true);
+	tx_index(kind, s->n - 1);
+	tx_markid(kind, rec);
+	return (e);
+}
+
+static void
+tx_setrec(int kind, struct pwtxent *e, void *rec)
+{
+	struct txset *s = &txsets[kind];
+
+	tx_logundo(kind, e - s->ent, e->rec, false);
+	e->rec = rec;
+	tx_index(kind, e - s->ent);
+	tx_markid(kind, rec);
+}
+
+static int
+tx_writeall(int fd, const char *p, size_t len)
+{
+	ssize_t w;
+
+	while (len > 0) {
+		if ((w = write(fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		p += w;
+		len -= w;
+	}
+	return (0);
+}
+
+/*
+ * Note a change for the journal: kind, operation, the name it was made
+ * under and, but for a deletion, the new record.  A change to the NIS
+ * passwd file follows a line naming that file.
+ */
+static void
+tx_jlog(int kind, char op, const char *name, const void *rec)
+{
+	char *p = NULL;
+	size_t need;
+
+	if (!conf.journal)
+		return;
+	if (rec != NULL) {
+		p = kind == PWTX_GR ? gr_make(rec) : pw_make(rec);
+		if (p == NULL)
+			err(1, "%s", kind == PWTX_GR ? "gr_make()" :
+			    "pw_make()");
+	}
+	need = strlen(name) + (p != NULL ? strlen(p) : 0) + 8;
+	if (kind == PWTX_NIS)
+		need += strlen(txnispath) + 5;
+	if (txjlen + need > txjcap) {
+		while (txjlen + need > txjcap)
+			txjcap = txjcap ? txjcap * 2 : 4096;
+		if ((txjbuf = realloc(txjbuf, txjcap)) == NULL)
+			err(1, "realloc()");
+	}
+	if (kind == PWTX_NIS)
+		txjlen += snprintf(txjbuf + txjlen, txjcap - txjlen,
+		    "nis %s\n", txnispath);
+	txjlen += snprintf(txjbuf + txjlen, txjcap - txjlen, "%c %c %s%s%s\n",
+	    kind == PWTX_PW ? 'u' : kind == PWTX_GR ? 'g' : 'n', op, name,
+	    p != NULL ? " " : "", p != NULL ? p : "");
+	free(p);
+}
+
+/*
+ * Append the changes noted since the last commit and sync the journal.
+ */
+static int
+tx_jwrite(void)
+{
+	if (txjlen == 0)
+		return (0);
+	if (txjfd == -1) {
+		errno = EBADF;
+		return (-1);
+	}
+	if (tx_writeall(txjfd, txjbuf, txjlen) == -1 ||
+	    tx_writeall(txjfd, "commit\n", 7) == -1 || fsync(txjfd) == -1)
+		return (-1);
+	txjoff += txjlen + 7;
+	txjlen = 0;
+	return (0);
+}
+
+/*
+ * Pending records, and those kept from the last fold, reach the callers
+ * of GETPWNAM() and friends as copies, as those read from the files
+ * do, so that changing one in place, as pw_user_mod() does before
+ * chgpwent(), cannot alter what is pending behind the undo log or what
+ * the next command is shown.  They last until the next command.
+ */
+static void *
+tx_handout(int kind, const void *rec)
+{
+	if (txncopy == txcopycap) {
+		txcopycap = txcopycap ? txcopycap * 2 : 16;
+		if ((txcopy = reallocarray(txcopy, txcopycap,
+		    sizeof(*txcopy))) == NULL)
+			err(1, "reallocarray()");
+	}
+	return (txcopy[txncopy++] = tx_dup(kind, rec));
+}
+
+static void
+tx_copydrop(void)
+{
+	while (txncopy > 0)
+		free(txcopy[--txncopy]);
+}
+
+/*
+ * The record called nam, as a copy for a caller if copy is set.
+ */
+static void *
+tx_lookup(int kind, const char *nam, bool copy)
+{
+	struct pwtxent *e;
+
+	if ((e = tx_bycur(kind, nam)) != NULL)
+		return (copy ? tx_handout(kind, e->rec) : e->rec);
+	if (tx_bykey(kind, nam) != NULL)
+		return (NULL);
+	if ((e = tx_setcur(&txviews[kind], kind, nam)) != NULL)
+		return (copy ? tx_handout(kind, e->rec) : e->rec);
+	if (tx_setkey(&txviews[kind], nam) != NULL)
+		return (NULL);
+	return (kind == PWTX_PW ? (void *)txbase._getpwnam(nam) :
+	    (void *)txbase._getgrnam(nam));
+}
+
+/*
+ * Whether the record of the file called nam is replaced by a pending
+ * one or one kept from the last fold.
+ */
+static bool
+tx_shadowed(int kind, const char *nam)
+{
+	return (tx_bykey(kind, nam) != NULL ||
+	    tx_setkey(&txviews[kind], nam) != NULL);
+}
+
+static void *
+tx_basenext(int kind)
+{
+	return (kind == PWTX_PW ? (void *)txbase._getpwent() :
+	    (void *)txbase._getgrent());
+}
+
+/*
+ * First record of the file numbered id that is not shadowed, for when
+ * the one the file's own lookup finds is.  This enumerates the file,
+ * so an enumeration tx_next() has under way is put back where it was.
+ */
+static void *
+tx_baseid(int kind, uintmax_t id)
+{
+	struct txset *s = &txsets[kind];
+	void *rec, *hit;
+	size_t i;
+
+	hit = NULL;
+	if (kind == PWTX_PW)
+		txbase._setpwent();
+	else
+		txbase._setgrent();
+	while (hit == NULL && (rec = tx_basenext(kind)) != NULL)
+		if (tx_id(kind, rec) == id && !tx_shadowed(kind,
+		    tx_name(kind, rec)))
+			hit = tx_handout(kind, rec);
+	if (kind == PWTX_PW)
+		txbase._endpwent();
+	else
+		txbase._endgrent();
+	if (s->inbase)
+		for (i = 0; i < s->basepos; i++)
+			tx_basenext(kind);
+	return (hit);
+}
+
+static void *
+tx_lookupid(int kind, uintmax_t id)
+{
+	struct pwtxent *e;
+	void *rec;
+
+	if ((e = tx_byid(kind, id)) != NULL)
+		return (tx_handout(kind, e->rec));
+	if ((e = tx_setid(&txviews[kind], kind, id)) != NULL)
+		return (tx_handout(kind, e->rec));
+	rec = kind == PWTX_PW ? (void *)txbase._getpwuid((uid_t)id) :
+	    (void *)txbase._getgrgid((gid_t)id);
+	if (rec != NULL && tx_shadowed(kind, tx_name(kind, rec)))
+		return (tx_baseid(kind, id));
+	return (rec);
+}
+
+static void *
+tx_next(int kind)
+{
+	struct txset *s = &txsets[kind];
+	struct pwtxent *e;
+	void *rec;
+
+	while (s->inbase) {
+		if ((rec = tx_basenext(kind)) == NULL) {
+			s->inbase = false;
+			break;
+		}
+		s->basepos++;
+		if ((e = tx_bykey(kind, tx_name(kind, rec))) == NULL)
+			return (rec);
+		if (e->rec != NULL)
+			return (tx_handout(kind, e->rec));
+	}
+	while (s->iter < s->n) {
+		e = &s->ent[s->iter++];
+		if (e->key == NULL && e->rec != NULL)
+			return (tx_handout(kind, e->rec));
+	}
+	return (NULL);
+}
+
+static void
+tx_rewind(int kind)
+{
+	txsets[kind].inbase = true;
+	txsets[kind].basepos = 0;
+	txsets[kind].iter = 0;
+}
+
+static struct passwd *
+tx_getpwnam(const char *nam)
+{
+	return (tx_lookup(PWTX_PW, nam, true));
+}
+
+static struct passwd *
+tx_getpwuid(uid_t uid)
+{
+	return (tx_lookupid(PWTX_PW, uid));
+}
+
+static void
+tx_setpwent(void)
+{
+	tx_rewind(PWTX_PW);
+	txbase._setpwent();
+}
+
+static void
+tx_endpwent(void)
+{
+	tx_rewind(PWTX_PW);
+	txbase._endpwent();
+}
+
+static struct passwd *
+tx_getpwent(void)
+{
+	return (tx_next(PWTX_PW));
+}
+
+static struct group *
+tx_getgrnam(const char *nam)
+{
+	return (tx_lookup(PWTX_GR, nam, true));
+}
+
+static struct group *
+tx_getgrgid(gid_t gid)
+{
+	return (tx_lookupid(PWTX_GR, gid));
+}
+
+static void
+tx_setgrent(void)
+{
+	tx_rewind(PWTX_GR);
+	txbase._setgrent();
+}
+
+static void
+tx_endgrent(void)
+{
+	tx_rewind(PWTX_GR);
+	txbase._endgrent();
+}
+
+static struct group *
+tx_getgrent(void)
+{
+	return (tx_next(PWTX_GR));
+}
+
+static bool
+tx_pending(int kind)
+{
+	struct txset *s = &txsets[kind];
+	size_t i;
+
+	for (i = 0; i < s->n; i++)
+		if (s->ent[i].key != NULL || s->ent[i].rec != NULL)
+			return (true);
+	return (false);
+}
+
+/*
+ * The records of a successful fold stay readable from memory, through
+ * txviews, until the next fold or command or the end of the
+ * transaction, so that a command reading back what it has just
+ * committed need not parse the files again.
+ */
+static void
+tx_keep(int kind)
+{
+	if (!tx_pending(kind))
+		return;
+	txviews[kind] = txsets[kind];
+	memset(&txsets[kind], 0, sizeof(txsets[kind]));
+}
+
+static void
+tx_viewdrop(void)
+{
+	struct txset *s;
+	size_t i;
+	int k;
+
+	for (k = 0; k < 2; k++) {
+		s = &txviews[k];
+		for (i = 0; i < s->n; i++) {
+			free(s->ent[i].key);
+			free(s->ent[i].rec);
+		}
+		free(s->ent);
+		free(s->head);
+		free(s->link);
+		memset(s, 0, sizeof(*s));
+	}
+}
+
+static void
+tx_reset(void)
+{
+	struct txset *s;
+	size_t i;
+	int k;
+
+	for (k = 0; k < 3; k++) {
+		s = &txsets[k];
+		for (i = 0; i < s->n; i++) {
+			free(s->ent[i].key);
+			free(s->ent[i].rec);
+		}
+		s->n = 0;
+		free(s->head);
+		s->head = NULL;
+		s->nbucket = s->nlink = s->linkcap = 0;
+		tx_rewind(k);
+		if (txids[k].valid)
+			bm_dealloc(&txids[k].bm);
+		txids[k].valid = false;
+	}
+	for (i = 0; i < txnlog; i++)
+		if (!txlog[i].added)
+			free(txlog[i].old);
+	txnlog = 0;
+}
+
+/*
+ * Put the group file back after master.passwd could not be updated, so
+ * that neither holds what the failed fold meant for both, and drop the
+ * journal's record of the fold.  If that fails the group file is left
+ * ahead of master.passwd, and that is said.
+ */
+static void
+tx_unfold(int ofd)
+{
+	int serrno = errno;
+
+	if (ofd == -1 || gr_restore(ofd) == -1)
+		warnx("%s holds changes that %s does not", getgrpath(_GROUP),
+		    getpwpath(_MASTERPASSWD));
+	else if (txjfd != -1 && ftruncate(txjfd, txjoff) == -1)
+		warn("%s", getpwpath(_PWJOURNAL));
+	errno = serrno;
+}
+
+/*
+ * Rewrite the files with everything pending.  Once that is done the
+ * journal, if it is held, has nothing left to replay.  The group file
+ * goes first; should master.passwd then fail, the group file it
+ * replaced is kept open to be put back.
+ */
+static int
+tx_fold(void)
+{
+	int rc = 0;
+
+	tx_viewdrop();
+	/* Left open by a fold that err(3) cut short */
+	if (txofd != -1)
+		close(txofd);
+	txofd = -1;
+	if (tx_pending(PWTX_GR)) {
+		if (tx_pending(PWTX_PW))
+			txofd = open(getgrpath(_GROUP), O_RDONLY | O_CLOEXEC);
+		rc = gr_commit(txsets[PWTX_GR].ent, txsets[PWTX_GR].n);
+	}
+	if (rc == 0 && tx_pending(PWTX_PW) &&
+	    (rc = pw_commit(txsets[PWTX_PW].ent, txsets[PWTX_PW].n)) != 0 &&
+	    tx_pending(PWTX_GR))
+		tx_unfold(txofd);
+	if (txofd != -1)
+		close(txofd);
+	txofd = -1;
+	/* Failing to update the NIS passwd file is not fatal */
+	if (rc == 0 && tx_pending(PWTX_NIS))
+		nis_commit(txnispath, txsets[PWTX_NIS].ent, txsets[PWTX_NIS].n);
+	if (rc == 0) {
+		tx_keep(PWTX_PW);
+		tx_keep(PWTX_GR);
+	}
+	tx_reset();
+	if (rc == 0 && txjfd != -1) {
+		if (ftruncate(txjfd, 0) == -1)
+			rc = -1;
+		txjoff = txjlen = 0;
+	}
+	return (rc);
+}
+
+/*
+ * Replay what a process that died before folding left in the journal,
+ * open and locked on txjfd.  Changes are applied only up to the last
+ * complete commit, and not to a file its fold had already installed.
+ */
+static void
+tx_replay(void)
+{
+	struct stat st;
+	FILE *fp;
+	char *line = NULL, *name, *rec, kind, op;
+	char nispath[MAXPATHLEN];
+	const char *path;
+	size_t linecap = 0;
+	ssize_t linelen;
+	off_t end, pos;
+	unsigned long lineno;
+	uintmax_t dev, ino;
+	bool skip[2] = { false, false };
+	void *r;
+	int fd, k, rc;
+
+	if ((fd = dup(txjfd)) == -1 || lseek(fd, 0, SEEK_SET) == -1 ||
+	    (fp = fdopen(fd, "r")) == NULL)
+		err(1, "%s", getpwpath(_PWJOURNAL));
+	end = pos = 0;
+	while ((linelen = getline(&line, &linecap, fp)) > 0) {
+		pos += linelen;
+		if (strcmp(line, "commit\n") == 0)
+			end = pos;
+		else if (sscanf(line, "fold %c %ju %ju", &kind, &dev,
+		    &ino) == 3) {
+			k = kind == 'u' ? PWTX_PW : PWTX_GR;
+			path = k == PWTX_PW ? getpwpath(_MASTERPASSWD) :
+			    getgrpath(_GROUP);
+			if (stat(path, &st) == 0 && (uintmax_t)st.st_dev == dev &&
+			    (uintmax_t)st.st_ino == ino)
+				skip[k] = true;
+		}
+	}
+
+	rewind(fp);
+	pos = 0;
+	lineno = 0;
+	nispath[0] = '\0';
+	while (pos < end && (linelen = getline(&line, &linecap, fp)) > 0) {
+		pos += linelen;
+		lineno++;
+		line[strcspn(line, "\n")] = '\0';
+		if (strcmp(line, "commit") == 0)
+			continue;
+		if (strncmp(line, "nis ", 4) == 0) {
+			strlcpy(nispath, line + 4, sizeof(nispath));
+			continue;
+		}
+		name = line + 4;
+		if (linelen < 5 || strchr("ugn", line[0]) == NULL ||
+		    line[1] != ' ' || line[3] != ' ')
+			goto bad;
+		k = line[0] == 'u' ? PWTX_PW : line[0] == 'g' ? PWTX_GR :
+		    PWTX_NIS;
+		if (k != PWTX_NIS && skip[k])
+			continue;
+		op = line[2];
+		r = NULL;
+		if ((rec = strchr(name, ' ')) != NULL) {
+			*rec++ = '\0';
+			r = k == PWTX_GR ? (void *)gr_scan(rec) :
+			    (void *)pw_scan(rec, PWSCAN_MASTER);
+			if (r == NULL)
+				goto bad;
+		}
+		/*
+		 * The NIS passwd file has no fold marker; changes to it are
+		 * applied again, which it tolerates
+		 */
+		if (k == PWTX_NIS) {
+			if (nispath[0] == '\0' || (op == 'd') != (r == NULL) ||
+			    strchr("acd", op) == NULL)
+				goto bad;
+			rc = pw_txnis(nispath, op == 'a' ? NULL : name, r) ?
+			    -1 : 0;
+		} else if (op == 'a' && r != NULL)
+			rc = pw_txadd(k, r);
+		else if (op == 'c' && r != NULL)
+			rc = pw_txchg(k, name, r);
+		else if (op == 'd' && r == NULL)
+			rc = pw_txdel(k, name);
+		else
+			goto bad;
+		free(r);
+		if (rc == -1)
+			errx(1, "%s: line %lu: cannot replay change to `%s'",
+			    getpwpath(_PWJOURNAL), lineno, name);
+	}
+	fclose(fp);
+	free(line);
+	if (tx_fold() == -1)
+		err(1, "%s: replay", getpwpath(_PWJOURNAL));
+	return;
+
+bad:
+	errx(1, "%s: line %lu: bad change record", getpwpath(_PWJOURNAL),
+	    lineno);
+}
+
+/*
+ * Take the journal: with conf.journal held for good, waiting for its
+ * lock, otherwise just long enough to replay it if it was abandoned.
+ */
+static void
+tx_jopen(void)
+{
+	struct stat st;
+	int fd;
+
+	txjchecked = true;
+	fd = open(getpwpath(_PWJOURNAL), O_RDWR | O_APPEND | O_CLOEXEC |
+	    (conf.journal ? O_CREAT : 0), 0600);
+	if (fd == -1) {
+		if (conf.journal)
+			err(1, "%s", getpwpath(_PWJOURNAL));
+		return;
+	}
+	if (flock(fd, LOCK_EX | (conf.journal ? 0 : LOCK_NB)) == -1) {
+		if (conf.journal)
+			err(1, "%s", getpwpath(_PWJOURNAL));
+		close(fd);		/* in use; its owner will fold */
+		return;
+	}
+	txjfd = fd;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+		tx_replay();
+	if (!conf.journal) {
+		close(txjfd);
+		txjfd = -1;
+	}
+}
+
+void
+pw_txbegin(void)
+{
+	if (txdepth++ > 0)
+		return;
+	txbase = PWF;
+	PWF._setpwent = tx_setpwent;
+	PWF._endpwent = tx_endpwent;
+	PWF._getpwent = tx_getpwent;
+	PWF._getpwuid = tx_getpwuid;
+	PWF._getpwnam = tx_getpwnam;
+	PWF._setgrent = tx_setgrent;
+	PWF._endgrent = tx_endgrent;
+	PWF._getgrent = tx_getgrent;
+	PWF._getgrgid = tx_getgrgid;
+	PWF._getgrnam = tx_getgrnam;
+	tx_rewind(PWTX_PW);
+	tx_rewind(PWTX_GR);
+	if (!txjchecked)
+		tx_jopen();
+}
+
+/*
+ * Whether the file of kind is all there is to read: no change to it is
+ * pending in the overlay.
+ */
+bool
+pw_txclean(int kind)
+{
+	return (txdepth == 0 || txsets[kind].n == 0);
+}
+
+/*
+ * Write out everything pending, unless an enclosing transaction will.
+ * With a journal this only appends to it.  The transaction stays open.
+ */
+int
+pw_txcommit(void)
+{
+	if (txdepth != 1)
+		return (0);
+	if (conf.journal)
+		return (tx_jwrite());
+	return (tx_fold());
+}
+
+int
+pw_txend(void)
+{
+	int rc = 0;
+
+	if (txdepth == 0)
+		return (0);
+	if (txdepth == 1) {
+		rc = pw_txcommit();
+		if (rc == 0 && conf.journal)
+			rc = tx_fold();
+		tx_viewdrop();
+		tx_copydrop();
+		PWF = txbase;
+	}
+	txdepth--;
+	return (rc);
+}
+
+/*
+ * Called by pw_commit() and gr_commit() once the new file is written
+ * and synced, before it is installed: record which file that will be,
+ * so that a replay can tell whether the fold got that far.
+ */
+int
+pw_txfolding(int kind, int tfd)
+{
+	struct stat st;
+	char buf[64];
+	int len;
+
+	if (txjfd == -1)
+		return (0);
+	if (fstat(tfd, &st) == -1)
+		return (-1);
+	len = snprintf(buf, sizeof(buf), "fold %c %ju %ju\n",
+	    kind == PWTX_PW ? 'u' : 'g', (uintmax_t)st.st_dev,
+	    (uintmax_t)st.st_ino);
+	if (tx_writeall(txjfd, buf, len) == -1 || fsync(txjfd) == -1)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Queue a new record.  Returns -1 if one by that name already exists.
+ */
+int
+pw_txadd(int kind, void *rec)
+{
+	struct pwtxent *e;
+	const char *nam = tx_name(kind, rec);
+
+	if (txdepth == 0) {
+		pw_txbegin();
+		if (pw_txadd(kind, rec) == -1) {
+			pw_txend();
+			return (-1);
+		}
+		return (pw_txend());
+	}
+	if (tx_lookup(kind, nam, false) != NULL)
+		return (-1);
+	if ((e = tx_bykey(kind, nam)) != NULL && e->rec == NULL)
+		tx_setrec(kind, e, tx_dup(kind, rec));	/* deleted, now back */
+	else
+		tx_append(kind, NULL, 0, tx_dup(kind, rec));
+	tx_jlog(kind, 'a', nam, rec);
+	return (0);
+}
+
+/*
+ * Queue a replacement for the record called name.  Returns -1 if there
+ * is no such record.
+ */
+int
+pw_txchg(int kind, const char *name, void *rec)
+{
+	struct pwtxent *e;
+	void *nrec, *old;
+
+	if (txdepth == 0) {
+		pw_txbegin();
+		if (pw_txchg(kind, name, rec) == -1) {
+			pw_txend();
+			return (-1);
+		}
+		return (pw_txend());
+	}
+	/* rec may well be the pending record itself, or point into it */
+	nrec = tx_dup(kind, rec);
+	if ((e = tx_bycur(kind, name)) == NULL) {
+		if (tx_bykey(kind, name) != NULL ||
+		    (old = tx_lookup(kind, name, false)) == NULL) {
+			free(nrec);
+			return (-1);
+		}
+		tx_append(kind, name, tx_id(kind, old), nrec);
+	} else
+		tx_setrec(kind, e, nrec);
+	tx_jlog(kind, 'c', name, nrec);
+	return (0);
+}
+
+/*
+ * Queue the removal of the record called name.  Returns -1 if there is
+ * no such record.
+ */
+int
+pw_txdel(int kind, const char *name)
+{
+	struct pwtxent *e;
+	void *old;
+
+	if (txdepth == 0) {
+		pw_txbegin();
+		if (pw_txdel(kind, name) == -1) {
+			pw_txend();
+			return (-1);
+		}
+		return (pw_txend());
+	}
+	if ((e = tx_bycur(kind, name)) == NULL) {
+		if (tx_bykey(kind, name) != NULL ||
+		    (old = tx_lookup(kind, name, false)) == NULL)
+			return (-1);
+		tx_append(kind, name, tx_id(kind, old), NULL);
+	} else
+		tx_setrec(kind, e, NULL);
+	tx_jlog(kind, 'd', name, NULL);
+	return (0);
+}
+
+/*
+ * Queue a change to the NIS passwd file path, to be applied after
+ * master.passwd: rec added if name is NULL, else put in place of the
+ * record called name, or that removed if rec is NULL.  Whether the
+ * file agrees is only found out then.  Returns 1 with errno set if
+ * changes to another NIS passwd file are already pending.
+ */
+int
+pw_txnis(const char *path, const char *name, void *rec)
+{
+	struct pwtxent *e;
+	const char *nam;
+	int rc;
+
+	if (txdepth == 0) {
+		pw_txbegin();
+		if ((rc = pw_txnis(path, name, rec)) != 0) {
+			pw_txend();
+			return (rc);
+		}
+		return (pw_txend());
+	}
+	if (tx_pending(PWTX_NIS) && strcmp(path, txnispath) != 0) {
+		errno = EBUSY;
+		return (1);
+	}
+	strlcpy(txnispath, path, sizeof(txnispath));
+	nam = name != NULL ? name : tx_name(PWTX_NIS, rec);
+	if (rec != NULL)
+		rec = tx_dup(PWTX_NIS, rec);
+	if ((e = tx_bycur(PWTX_NIS, nam)) != NULL ||
+	    ((e = tx_bykey(PWTX_NIS, nam)) != NULL && e->rec == NULL))
+		tx_setrec(PWTX_NIS, e, rec);
+	else
+		tx_append(PWTX_NIS, name, 0, rec);
+	tx_jlog(PWTX_NIS, name == NULL ? 'a' : rec == NULL ? 'd' : 'c', nam,
+	    rec);
+	return (0);
+}
+
+/*
+ * Position to roll back to should what follows fail.  It is taken as
+ * each command starts, so the last fold's records and the copies handed
+ * out to the last command are dropped too: a command sees its own
+ * commits, not another's.
+ */
+size_t
+pw_txsave(void)
+{
+	tx_viewdrop();
+	tx_copydrop();
+	return (txnlog);
+}
+
+/*
+ * Forget every change made since pw_txsave() returned mark, but for
+ * those already in the journal: they are replayed after a crash, as
+ * without a journal they would already be in the files, so they stay.
+ */
+void
+pw_txrollback(size_t mark)
+{
+	struct txundo *u;
+	struct txset *s;
+	struct pwtxent *e;
+
+	while (txnlog > mark && txlog[txnlog - 1].jpos >= txjoff) {
+		u = &txlog[--txnlog];
+		txjlen = u->jpos - txjoff;
+		s = &txsets[u->kind];
+		e = &s->ent[u->ent];
+		free(e->rec);
+		if (u->added) {
+			free(e->key);
+			s->n--;
+		} else {
+			e->rec = u->old;
+			tx_index(u->kind, u->ent);
+		}
+
+		/*
+		 * The ids in use may have counted the record; build them
+		 * again when next wanted
+		 */
+		if (txids[u->kind].valid) {
+			bm_dealloc(&txids[u->kind].bm);
+			txids[u->kind].valid = false;
+		}
+	}
+}
+
+/*
+ * Fill bm from the ids in use between min and max remembered by an
+ * earlier pw_txidput(), if there is one.
+ */
+bool
+pw_txidget(int kind, uintmax_t min, uintmax_t max, struct bitmap *bm)
+{
+	struct txids *c = &txids[kind];
+
+	if (txdepth == 0 || !c->valid || c->min != min || c->max != max)
+		return (false);
+	*bm = bm_dup(&c->bm);
+	return (true);
+}
+
+/*
+ * Add the ids of pending records to bm, a set of the ids in use between
+ * min and max, and remember it until the next commit.
+ */
+void
+pw_txidput(int kind, uintmax_t min, uintmax_t max, struct bitmap *bm)
+{
+	struct txset *s = &txsets[kind];
+	struct txids *c = &txids[kind];
+	uintmax_t id;
+	size_t i;
+
+	for (i = 0; i < s->n; i++) {
+		if (s->ent[i].rec == NULL)
+			continue;
+		id = tx_id(kind, s->ent[i].rec);
+		if (id >= min && id <= max)
+			bm_setbit(bm, (int64_t)(id - min));
+	}
+	if (txdepth == 0)
+		return;
+	if (c->valid)
+		bm_dealloc(&c->bm);
+	c->bm = bm_dup(bm);
+	c->min = min;
+	c->max = max;
+	c->valid = true;
+}
+
+static int
+tx_namecmp(const void *a, const void *b)
+{
+	return (strcmp(((const struct txname *)a)->name,
+	    ((const struct txname *)b)->name));
+}
+
+/*
+ * Entry of the sorted names called the len bytes at p, or SIZE_MAX.
+ */
+static size_t
+tx_namefind(const struct txname *names, size_t n, const char *p,
+    size_t len)
+{
+	size_t lo = 0, hi = n, mid;
+	int c;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if ((c = strncmp(names[mid].name, p, len)) == 0 &&
+		    names[mid].name[len] != '\0')
+			c = 1;
+		if (c == 0)
+			return (names[mid].ent);
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (SIZE_MAX);
+}
+
+static void
+tx_write(struct txout *o, const char *p, size_t len)
+{
+	ssize_t w;
+
+	while (len > 0 && o->error == 0) {
+		if ((w = write(o->fd, p, len)) == -1) {
+			if (errno != EINTR)
+				o->error = errno;
+			continue;
+		}
+		p += w;
+		len -= w;
+	}
+}
+
+static void
+tx_flush(struct txout *o)
+{
+	tx_write(o, o->buf, o->len);
+	o->len = 0;
+}
+
+static void
+tx_put(struct txout *o, const char *p, size_t len)
+{
+	if (o->len + len > sizeof(o->buf)) {
+		tx_flush(o);
+		if (len >= sizeof(o->buf) / 2) {
+			tx_write(o, p, len);
+			return;
+		}
+	}
+	memcpy(o->buf + o->len, p, len);
+	o->len += len;
+}
+
+static void
+tx_putrec(struct txout *o, int kind, const void *rec)
+{
+	char *p;
+
+	p = kind == PWTX_GR ? gr_make(rec) : pw_make(rec);
+	if (p == NULL)
+		err(1, "%s", kind == PWTX_GR ? "gr_make()" : "pw_make()");
+	tx_put(o, p, strlen(p));
+	tx_put(o, "\n", 1);
+	free(p);
+}
+
+/*
+ * Copy the passwd or group file open on ifd to ofd in one sequential
+ * pass, applying a change set: records named by a change are replaced
+ * or dropped where they stand, new ones are appended, and everything
+ * else is written through unchanged.  If check is given each line is
+ * passed to it first.  Returns 0 once ofd is synced, or an errno value.
+ * For a NIS passwd file, which need not agree with master.passwd, a
+ * record that is already there or missing is warned of and written
+ * anyway.
+ */
+int
+pw_txrewrite(int kind, int ifd, int ofd, struct pwtxent *ent, size_t n,
+    bool (*check)(const char *, size_t, unsigned long))
+{
+	struct txout *o = &txout;
+	struct txname *keys, *adds;
+	struct stat st;
+	const char *what = kind == PWTX_GR ? "group" : "user";
+	char *map, *p, *end, *next, *run, *colon;
+	size_t nkeys, nadds, i, size;
+	unsigned long lineno;
+	bool *done;
+	int rc = 0;
+
+	if (fstat(ifd, &st) == -1)
+		return (errno);
+	size = st.st_size;
+	map = NULL;
+	if (size > 0) {
+		map = mmap(NULL, size, PROT_READ, MAP_SHARED, ifd, 0);
+		if (map == MAP_FAILED)
+			return (errno);
+		madvise(map, size, MADV_SEQUENTIAL);
+	}
+	if ((keys = calloc(n + 1, sizeof(*keys))) == NULL ||
+	    (adds = calloc(n + 1, sizeof(*adds))) == NULL ||
+	    (done = calloc(n + 1, sizeof(*done))) == NULL)
+		err(1, "calloc()");
+	for (i = nkeys = nadds = 0; i < n; i++) {
+		if (ent[i].key != NULL) {
+			keys[nkeys].name = ent[i].key;
+			keys[nkeys++].ent = i;
+		} else if (ent[i].rec != NULL) {
+			adds[nadds].name = tx_name(kind, ent[i].rec);
+			adds[nadds++].ent = i;
+		}
+	}
+	qsort(keys, nkeys, sizeof(*keys), tx_namecmp);
+	qsort(adds, nadds, sizeof(*adds), tx_namecmp);
+
+	o->fd = ofd;
+	o->error = 0;
+	o->len = 0;
+	lineno = 0;
+	end = map + size;
+	for (p = run = map; p < end; p = next) {
+		next = memchr(p, '\n', end - p);
+		next = next != NULL ? next + 1 : end;
+		if (check != NULL && !check(p, next - p, ++lineno)) {
+			rc = EIO;
+			goto done;
+		}
+		if (*p == '#' || *p == '\n' ||
+		    (colon = memchr(p, ':', next - p)) == NULL)
+			continue;
+		i = tx_namefind(keys, nkeys, p, colon - p);
+		if (i != SIZE_MAX && done[i])
+			i = SIZE_MAX;	/* a duplicate; leave it be */
+		if (i == SIZE_MAX) {
+			i = tx_namefind(adds, nadds, p, colon - p);
+			if (i == SIZE_MAX || done[i])
+				continue;
+			warnx("%s `%s' already exists", what,
+			    tx_name(kind, ent[i].rec));
+			if (kind != PWTX_NIS) {
+				rc = EEXIST;
+				goto done;
+			}
+		}
+		tx_put(o, run, p - run);
+		run = next;
+		done[i] = true;
+		if (ent[i].rec != NULL)
+			tx_putrec(o, kind, ent[i].rec);
+	}
+	tx_put(o, run, end - run);
+	if (run < end && end[-1] != '\n')
+		tx_put(o, "\n", 1);
+
+	for (i = 0; i < nkeys; i++)
+		if (!done[keys[i].ent]) {
+			warnx("%s `%s' does not exist", what, keys[i].name);
+			if (kind != PWTX_NIS) {
+				rc = ENOENT;
+				goto done;
+			}
+			if (ent[keys[i].ent].rec != NULL)
+				tx_putrec(o, kind, ent[keys[i].ent].rec);
+		}
+	for (i = 0; i < n; i++)
+		if (ent[i].key == NULL && ent[i].rec != NULL && !done[i])
+			tx_putrec(o, kind, ent[i].rec);
+	tx_flush(o);
+	if ((rc = o->error) == 0 && fsync(ofd) == -1)
+		rc = errno;
+
+done:
+	if (map != NULL)
+		munmap(map, size);
+	free(keys);
+	free(adds);
+	free(done);
+	return (rc);
+}
+
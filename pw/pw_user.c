@@ -52,6 +52,7 @@
 
 #include "pw.h"
 #include "bitmap.h"
+#include "idstate.h"
 #include "psdate.h"
 #include "pathnames.h"
 
@@ -74,10 +75,14 @@ static struct passwd fakeuser = {
 	0
 };
 
-static int	 print_user(struct passwd *pwd, bool pretty, bool v7);
-static uid_t	 pw_uidpolicy(struct userconf *cnf, intmax_t id);
-static uid_t	 pw_gidpolicy(struct userconf *cnf, char *grname, char *nam,
-    gid_t prefer, bool dryrun);
+struct grindex;
+
+static int	 print_user(struct passwd *pwd, bool pretty, bool v7,
+    struct grindex *gi);
+static struct bitmap pw_uidused(struct userconf *cnf);
+static uid_t	 pw_uidtake(struct userconf *cnf, struct bitmap *bm);
+static uid_t	 pw_idtake(struct userconf *cmdcnf, struct userconf *cnf,
+    struct bitmap *ubm, struct bitmap *gbm, gid_t *gid);
 static char	*pw_homepolicy(struct userconf * cnf, char *homedir,
     const char *user);
 static char	*pw_shellpolicy(struct userconf * cnf);
@@ -375,105 +380,151 @@ pw_userlock(char *arg1, int mode)
 	return (EXIT_SUCCESS);
 }
 
-static uid_t
-pw_uidpolicy(struct userconf * cnf, intmax_t id)
+/*
+ * Start the set of uids in use in the configured range, relative to
+ * min_uid, from what is known without reading the password file; see
+ * pw_gidknown().
+ */
+static bool
+pw_uidknown(struct userconf *cnf, struct bitmap *bm)
 {
-	struct passwd  *pwd;
-	struct bitmap   bm;
-	uid_t           uid = (uid_t) - 1;
 
-	/*
-	 * Check the given uid, if any
-	 */
-	if (id >= 0) {
-			uid = (uid_t) id;
-
-			if ((pwd = GETPWUID(uid)) != NULL && conf.checkduplicate)
-				errx(EX_DATAERR,
-				    "uid `%" PW_UID_PRI "' has already been allocated",
-				    PW_UID_ARG(pwd->pw_uid));
-			return (uid);
-		}
-	/*
-	 * We need to allocate the next available uid under one of
-	 * two policies a) Grab the first unused uid b) Grab the
-	 * highest possible unused uid
-	 */
 	if (cnf->min_uid >= cnf->max_uid) {	/* Sanity
 						 * claus^H^H^H^Hheck */
 		cnf->min_uid = 1000;
 		cnf->max_uid = 32000;
 	}
-	bm = bm_alloc(cnf->max_uid - cnf->min_uid + 1);
 
 	/*
-	 * Now, let's fill the bitmap from the password file
+	 * Earlier commands in this transaction may have built the set
+	 * already
 	 */
-	SETPWENT();
-	while ((pwd = GETPWENT()) != NULL)
-		if (pwd->pw_uid >= (uid_t) cnf->min_uid && pwd->pw_uid <= (uid_t) cnf->max_uid)
-			bm_setbit(&bm, pwd->pw_uid - cnf->min_uid);
-	ENDPWENT();
+	if (pw_txidget(PWTX_PW, cnf->min_uid, cnf->max_uid, bm))
+		return (true);
+	*bm = bm_alloc((int64_t)cnf->max_uid - cnf->min_uid + 1);
+	if (!cnf->idstate ||
+	    !ids_load(IDS_UID, cnf->min_uid, cnf->max_uid, bm))
+		return (false);
+	pw_txidput(PWTX_PW, cnf->min_uid, cnf->max_uid, bm);
+	return (true);
+}
+
+/*
+ * Keep a set filled from the password file for later commands.
+ */
+static void
+pw_uidscanned(struct userconf *cnf, struct bitmap *bm)
+{
+
+	if (cnf->idstate)
+		ids_save(IDS_UID, cnf->min_uid, cnf->max_uid, bm);
+	pw_txidput(PWTX_PW, cnf->min_uid, cnf->max_uid, bm);
+}
+
+/*
+ * Build the set of uids in use in the configured range, relative to
+ * min_uid, including those reserved by other callers.
+ */
+static struct bitmap
+pw_uidused(struct userconf *cnf)
+{
+	struct passwd  *pwd;
+	struct bitmap   bm;
+
+	if (!pw_uidknown(cnf, &bm)) {
+		SETPWENT();
+		while ((pwd = GETPWENT()) != NULL)
+			if (pwd->pw_uid >= (uid_t) cnf->min_uid &&
+			    pwd->pw_uid <= (uid_t) cnf->max_uid)
+				bm_setbit(&bm, pwd->pw_uid - cnf->min_uid);
+		ENDPWENT();
+		pw_uidscanned(cnf, &bm);
+	}
+	ids_reserved(IDS_UID, cnf->min_uid, &bm);
+	return (bm);
+}
+
+/*
+ * Choose a uid from a set built by pw_uidused() and mark it as used.
+ */
+static uid_t
+pw_uidtake(struct userconf *cnf, struct bitmap *bm)
+{
+	uid_t           uid = (uid_t) - 1;
 
 	/*
 	 * Then apply the policy, with fallback to reuse if necessary
 	 */
-	if (cnf->reuse_uids || (uid = (uid_t) (bm_lastset(&bm) + cnf->min_uid + 1)) > cnf->max_uid)
-		uid = (uid_t) (bm_firstunset(&bm) + cnf->min_uid);
+	if (cnf->reuse_uids || (uid = (uid_t) (bm_lastset(bm) + cnf->min_uid + 1)) > cnf->max_uid)
+		uid = (uid_t) (bm_firstunset(bm) + cnf->min_uid);
 
 	/*
 	 * Another sanity check
 	 */
 	if (uid < cnf->min_uid || uid > cnf->max_uid)
 		errx(EX_SOFTWARE, "unable to allocate a new uid - range fully used");
-	bm_dealloc(&bm);
+	bm_setbit(bm, uid - cnf->min_uid);
 	return (uid);
 }
 
-static uid_t
-pw_gidpolicy(struct userconf *cnf, char *grname, char *nam, gid_t prefer, bool dryrun)
+/*
+ * Starting at pos in ubm, find the first id free both as a uid and as a
+ * gid.  Above the gid range only a few ids are probed one at a time,
+ * since the gid set does not cover them.
+ */
+static int64_t
+pw_idjoint(struct userconf *cmdcnf, struct userconf *cnf, struct bitmap *ubm,
+    struct bitmap *gbm, int64_t pos)
 {
-	struct group   *grp;
-	gid_t           gid = (uid_t) - 1;
-
-	/*
-	 * Check the given gid, if any
-	 */
-	SETGRENT();
-	if (grname) {
-		if ((grp = GETGRNAM(grname)) == NULL) {
-			gid = pw_checkgid(grname);
-			grp = GETGRGID(gid);
-		}
-		gid = grp->gr_gid;
-	} else if ((grp = GETGRNAM(nam)) != NULL) {
-		gid = grp->gr_gid;  /* Already created? Use it anyway... */
-	} else {
-		intmax_t		grid = -1;
-
-		/*
-		 * We need to auto-create a group with the user's name. We
-		 * can send all the appropriate output to our sister routine
-		 * bit first see if we can create a group with gid==uid so we
-		 * can keep the user and group ids in sync. We purposely do
-		 * NOT check the gid range if we can force the sync. If the
-		 * user's name dups an existing group, then the group add
-		 * function will happily handle that case for us and exit.
-		 */
-		if (GETGRGID(prefer) == NULL)
-			grid = prefer;
-		if (dryrun) {
-			gid = pw_groupnext(cnf, true);
-		} else {
-			if (grid == -1)
-				grid =  pw_groupnext(cnf, true);
-			groupadd(cnf, nam, grid, NULL, -1, false, false, false);
-			if ((grp = GETGRNAM(nam)) != NULL)
-				gid = grp->gr_gid;
-		}
+	int64_t         id, g;
+	int             probes = 64;
+
+	for (pos = bm_nextunset(ubm, pos); pos < ubm->size;
+	    pos = bm_nextunset(ubm, pos)) {
+		id = pos + cmdcnf->min_uid;
+		if (id >= cnf->min_gid && id <= cnf->max_gid) {
+			g = bm_nextunset(gbm, id - cnf->min_gid) + cnf->min_gid;
+			if (g == id)
+				return (id);
+			pos = g - cmdcnf->min_uid;
+		} else if (GETGRGID((gid_t)id) == NULL)
+			return (id);
+		else if (--probes == 0)
+			break;
+		else
+			pos++;
 	}
-	ENDGRENT();
-	return (gid);
+	return (-1);
+}
+
+/*
+ * Choose the uid and gid for a new user whose own group is about to be
+ * created, from sets built by pw_uidused() and pw_gidused(), and mark
+ * both as used.  The first id the uid policy would reach that is also
+ * free as a gid is used for both, so that they match whenever possible.
+ * Failing that the uid follows the policy and the gid comes from the
+ * group policy.
+ */
+static uid_t
+pw_idtake(struct userconf *cmdcnf, struct userconf *cnf, struct bitmap *ubm,
+    struct bitmap *gbm, gid_t *gid)
+{
+	int64_t         first, start, id;
+
+	first = start = bm_firstunset(ubm);
+	if (!cmdcnf->reuse_uids && bm_lastset(ubm) + 1 < ubm->size)
+		start = bm_lastset(ubm) + 1;
+	if ((id = pw_idjoint(cmdcnf, cnf, ubm, gbm, start)) == -1 &&
+	    start != first)
+		id = pw_idjoint(cmdcnf, cnf, ubm, gbm, first);
+	if (id == -1) {
+		id = pw_uidtake(cmdcnf, ubm);
+		*gid = pw_gidtake(cnf, gbm, -1);
+		return ((uid_t)id);
+	}
+	bm_setbit(ubm, id - cmdcnf->min_uid);
+	*gid = pw_gidtake(cnf, gbm, id);
+	return ((uid_t)id);
 }
 
 static char *
@@ -597,12 +648,214 @@ pw_password(struct userconf * cnf, char const * user)
 	return pw_pwcrypt(pwbuf);
 }
 
+/*
+ * The groups each user is a member of, and the name of each gid, from
+ * one walk of the group database, so that printing a user is not
+ * another walk of it.  Both are open hash tables of a power of two
+ * size, at most half full.
+ */
+struct grmember {
+	const char	*user;		/* NULL in a free slot */
+	StringList	*groups;	/* in the order of the group file */
+};
+
+struct grbygid {
+	const char	*name;		/* NULL in a free slot */
+	gid_t		 gid;
+};
+
+struct grindex {
+	struct grmember	*members;
+	size_t		 nmembers, msize;
+	struct grbygid	*gids;
+	size_t		 ngids, gsize;
+	StringList	*names;		/* the strings both point to */
+};
+
+static size_t
+grindex_hash(const char *p)
+{
+	uint32_t h = 2166136261U;
+
+	while (*p != '\0')
+		h = (h ^ (unsigned char)*p++) * 16777619U;
+	return (h);
+}
+
+static char *
+grindex_name(struct grindex *gi, const char *name)
+{
+	char *p;
+
+	if ((p = strdup(name)) == NULL || sl_add(gi->names, p) == -1)
+		err(EX_OSERR, "strdup()");
+	return (p);
+}
+
+static struct grmember *
+grindex_member(struct grindex *gi, const char *user)
+{
+	struct grmember	*m, *old;
+	size_t		 i, osize;
+
+	if (2 * (gi->nmembers + 1) > gi->msize) {
+		old = gi->members;
+		osize = gi->msize;
+		gi->msize = osize ? osize * 2 : 64;
+		if ((gi->members = calloc(gi->msize,
+		    sizeof(*gi->members))) == NULL)
+			err(EX_OSERR, "calloc()");
+		for (i = 0; i < osize; i++) {
+			if (old[i].user == NULL)
+				continue;
+			m = &gi->members[grindex_hash(old[i].user) &
+			    (gi->msize - 1)];
+			while (m->user != NULL)
+				if (++m == gi->members + gi->msize)
+					m = gi->members;
+			*m = old[i];
+		}
+		free(old);
+	}
+	m = &gi->members[grindex_hash(user) & (gi->msize - 1)];
+	while (m->user != NULL && strcmp(m->user, user) != 0)
+		if (++m == gi->members + gi->msize)
+			m = gi->members;
+	if (m->user == NULL) {
+		m->user = grindex_name(gi, user);
+		if ((m->groups = sl_init()) == NULL)
+			err(EX_OSERR, "sl_init()");
+		gi->nmembers++;
+	}
+	return (m);
+}
+
+/*
+ * Name the first group numbered gid, as GETGRGID() would.
+ */
+static void
+grindex_gid(struct grindex *gi, gid_t gid, const char *name)
+{
+	struct grbygid	*g, *old;
+	size_t		 i, osize;
+
+	if (2 * (gi->ngids + 1) > gi->gsize) {
+		old = gi->gids;
+		osize = gi->gsize;
+		gi->gsize = osize ? osize * 2 : 64;
+		if ((gi->gids = calloc(gi->gsize, sizeof(*gi->gids))) == NULL)
+			err(EX_OSERR, "calloc()");
+		for (i = 0; i < osize; i++) {
+			if (old[i].name == NULL)
+				continue;
+			g = &gi->gids[old[i].gid & (gi->gsize - 1)];
+			while (g->name != NULL)
+				if (++g == gi->gids + gi->gsize)
+					g = gi->gids;
+			*g = old[i];
+		}
+		free(old);
+	}
+	g = &gi->gids[gid & (gi->gsize - 1)];
+	while (g->name != NULL) {
+		if (g->gid == gid)
+			return;
+		if (++g == gi->gids + gi->gsize)
+			g = gi->gids;
+	}
+	g->name = name;
+	g->gid = gid;
+	gi->ngids++;
+}
+
+static void
+grindex_build(struct grindex *gi)
+{
+	struct group	*grp;
+	struct grmember	*m;
+	char		*name;
+	int		 i;
+
+	memset(gi, 0, sizeof(*gi));
+	if ((gi->names = sl_init()) == NULL)
+		err(EX_OSERR, "sl_init()");
+	SETGRENT();
+	while ((grp = GETGRENT()) != NULL) {
+		name = grindex_name(gi, grp->gr_name);
+		grindex_gid(gi, grp->gr_gid, name);
+		for (i = 0; grp->gr_mem != NULL && grp->gr_mem[i] != NULL;
+		    i++) {
+			m = grindex_member(gi, grp->gr_mem[i]);
+			/* Listed twice in one group; show it once */
+			if (m->groups->sl_cur > 0 &&
+			    m->groups->sl_str[m->groups->sl_cur - 1] == name)
+				continue;
+			if (sl_add(m->groups, name) == -1)
+				err(EX_OSERR, "sl_add()");
+		}
+	}
+	ENDGRENT();
+}
+
+static void
+grindex_free(struct grindex *gi)
+{
+	size_t i;
+
+	for (i = 0; i < gi->msize; i++)
+		if (gi->members[i].user != NULL)
+			sl_free(gi->members[i].groups, 0);
+	free(gi->members);
+	free(gi->gids);
+	sl_free(gi->names, 1);
+}
+
+static const char *
+grindex_gidname(const struct grindex *gi, gid_t gid)
+{
+	const struct grbygid *g;
+
+	if (gi->gsize == 0)
+		return (NULL);
+	g = &gi->gids[gid & (gi->gsize - 1)];
+	while (g->name != NULL) {
+		if (g->gid == gid)
+			return (g->name);
+		if (++g == gi->gids + gi->gsize)
+			g = gi->gids;
+	}
+	return (NULL);
+}
+
+static StringList *
+grindex_groups(const struct grindex *gi, const char *user)
+{
+	const struct grmember *m;
+
+	if (gi->msize == 0)
+		return (NULL);
+	m = &gi->members[grindex_hash(user) & (gi->msize - 1)];
+	while (m->user != NULL) {
+		if (strcmp(m->user, user) == 0)
+			return (m->groups);
+		if (++m == gi->members + gi->msize)
+			m = gi->members;
+	}
+	return (NULL);
+}
+
+/*
+ * Print a user; gi, if not NULL, indexes the group database for
+ * printing many of them.
+ */
 static int
-print_user(struct passwd * pwd, bool pretty, bool v7)
+print_user(struct passwd * pwd, bool pretty, bool v7, struct grindex *gi)
 {
-	int		j;
+	size_t		j;
 	char           *p;
-	struct group   *grp = GETGRGID(pwd->pw_gid);
+	const char     *grname;
+	struct grindex	gione;
+	StringList     *groups;
 	char            uname[60] = "User &", office[60] = "[None]",
 			wphone[60] = "[None]", hphone[60] = "[None]";
 	char		acexpire[32] = "[None]", pwexpire[32] = "[None]";
@@ -614,6 +867,11 @@ print_user(struct passwd * pwd, bool pretty, bool v7)
 		free(p);
 		return (EXIT_SUCCESS);
 	}
+	if (gi == NULL) {
+		grindex_build(&gione);
+		gi = &gione;
+	}
+	grname = grindex_gidname(gi, pwd->pw_gid);
 
 	if ((p = strtok(pwd->pw_gecos, ",")) != NULL) {
 		strlcpy(uname, p, sizeof(uname));
@@ -650,26 +908,18 @@ print_user(struct passwd * pwd, bool pretty, bool v7)
 	       "Work Phone: %-26.26s Home Phone: %s\n"
 	       "Acc Expire: %-26.26s Pwd Expire: %s\n",
 	       pwd->pw_name, PW_UID_ARG(pwd->pw_uid),
-	       grp ? grp->gr_name : "(invalid)", PW_GID_ARG(pwd->pw_gid),
+	       grname ? grname : "(invalid)", PW_GID_ARG(pwd->pw_gid),
 	       uname, pwd->pw_dir, pwd->pw_class,
 	       pwd->pw_shell, office, wphone, hphone,
 	       acexpire, pwexpire);
-        SETGRENT();
-	j = 0;
-	while ((grp=GETGRENT()) != NULL) {
-		int     i = 0;
-		if (grp->gr_mem != NULL) {
-			while (grp->gr_mem[i] != NULL) {
-				if (strcmp(grp->gr_mem[i], pwd->pw_name)==0) {
-					printf(j++ == 0 ? "    Groups: %s" : ",%s", grp->gr_name);
-					break;
-				}
-				++i;
-			}
-		}
-	}
-	ENDGRENT();
-	printf("%s", j ? "\n" : "");
+	if ((groups = grindex_groups(gi, pwd->pw_name)) != NULL) {
+		for (j = 0; j < groups->sl_cur; j++)
+			printf(j == 0 ? "    Groups: %s" : ",%s",
+			    groups->sl_str[j]);
+		printf("%s", j ? "\n" : "");
+	}
+	if (gi == &gione)
+		grindex_free(&gione);
 	return (EXIT_SUCCESS);
 }
 
@@ -770,19 +1020,35 @@ int
 pw_user_next(int argc, char **argv, char *name __unused)
 {
 	struct userconf *cnf = NULL;
+	struct bitmap ubm, gbm;
 	const char *cfg = NULL;
+	const char *errstr;
+	uintmax_t *uids, *gids;
+	intmax_t count = 0, ttl = 0, i;
 	int ch;
 	bool quiet = false;
-	uid_t next;
+	gid_t gid;
 
-	while ((ch = getopt(argc, argv, "C:q")) != -1) {
+	while ((ch = getopt(argc, argv, "C:c:qt:")) != -1) {
 		switch (ch) {
 		case 'C':
 			cfg = optarg;
 			break;
+		case 'c':
+			count = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr)
+				errx(EX_USAGE, "count is %s: `%s'", errstr,
+				    optarg);
+			break;
 		case 'q':
 			quiet = true;
 			break;
+		case 't':
+			ttl = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr)
+				errx(EX_USAGE, "reservation time is %s: `%s'",
+				    errstr, optarg);
+			break;
 		default:
 			usage();
 		}
@@ -797,36 +1063,175 @@ pw_user_next(int argc, char **argv, char *name __unused)
 
 	cnf = get_userconfig(cfg);
 
-	next = pw_uidpolicy(cnf, -1);
+	/*
+	 * Hand out distinct ids from one pass over each file, pairing
+	 * gid with uid the way useradd does, and optionally reserve them
+	 * for ttl seconds.
+	 */
+	if (count == 0)
+		count = 1;
+	if ((uids = calloc(count, sizeof(*uids))) == NULL ||
+	    (gids = calloc(count, sizeof(*gids))) == NULL)
+		err(EX_OSERR, "calloc()");
+	if (ttl > 0)
+		ids_lock();
+	ubm = pw_uidused(cnf);
+	gbm = pw_gidused(cnf);
+	for (i = 0; i < count; i++) {
+		uids[i] = pw_idtake(cnf, cnf, &ubm, &gbm, &gid);
+		gids[i] = gid;
+	}
+	if (ttl > 0) {
+		ids_reserve(IDS_UID, uids, count, ttl);
+		ids_reserve(IDS_GID, gids, count, ttl);
+		ids_unlock();
+	}
+	for (i = 0; i < count; i++)
+		printf("%" PW_UID_PRI ":%" PW_GID_PRI "\n",
+		    PW_UID_ARG(uids[i]), PW_GID_ARG(gids[i]));
+	bm_dealloc(&ubm);
+	bm_dealloc(&gbm);
+	free(uids);
+	free(gids);
+	return (EXIT_SUCCESS);
+}
 
-	printf("%" PW_UID_PRI ":", PW_UID_ARG(next));
-	pw_groupnext(cnf, quiet);
+/*
+ * Print a user as usershow was asked to; gi is needed for -P and -o.
+ */
+static void
+show_user(struct passwd *pwd, int format, bool pretty, bool v7,
+    struct grindex *gi)
+{
+	if (format != PWOUT_NONE)
+		pw_outuser(pwd, grindex_gidname(gi, pwd->pw_gid),
+		    grindex_groups(gi, pwd->pw_name));
+	else
+		print_user(pwd, pretty, v7, gi);
+}
 
-	return (EXIT_SUCCESS);
+static bool
+match_user(const struct pwquery *q, const struct passwd *pwd,
+    const struct grindex *gi)
+{
+	if (gi == NULL)
+		return (pw_query_user(q, pwd, NULL, NULL));
+	return (pw_query_user(q, pwd, grindex_gidname(gi, pwd->pw_gid),
+	    grindex_groups(gi, pwd->pw_name)));
+}
+
+/*
+ * Print the users that match q, in a single pass over the database, or
+ * by a lookup if q names the user.  An id is looked up too, but only
+ * to find there is nobody to print: ids may be shared.
+ */
+static void
+show_query(struct pwquery *q, int format, bool pretty, bool v7,
+    struct grindex *gi)
+{
+	struct passwd *pwd;
+	const char *name;
+	intmax_t id;
+
+	if ((name = pw_query_key(q, &id)) != NULL || id >= 0) {
+		pwd = name != NULL ? GETPWNAM(name) : GETPWUID(id);
+		if (pwd == NULL)
+			return;
+	}
+	if (name != NULL) {
+		if (match_user(q, pwd, gi) && pw_query_take(q, pwd))
+			show_user(pwd, format, pretty, v7, gi);
+	} else {
+		SETPWENT();
+		while ((pwd = GETPWENT()) != NULL) {
+			if (!match_user(q, pwd, gi))
+				continue;
+			if (pw_query_take(q, pwd))
+				show_user(pwd, format, pretty, v7, gi);
+			if (pw_query_done(q))
+				break;
+		}
+		ENDPWENT();
+	}
+	while ((pwd = pw_query_next(q)) != NULL)
+		show_user(pwd, format, pretty, v7, gi);
+}
+
+/*
+ * Print the users named, or numbered, by keys in the order given, each
+ * found through the passwd index rather than a scan.  One not found is
+ * reported and skipped, or faked with -F.
+ */
+static int
+show_keys(StringList *keys, int format, bool pretty, bool v7, bool force)
+{
+	struct passwd *pwd;
+	struct grindex gi;
+	char *key;
+	size_t i;
+	int rc;
+	bool indexed;
+
+	indexed = pretty || format != PWOUT_NONE;
+	if (indexed)
+		grindex_build(&gi);
+	if (format != PWOUT_NONE)
+		pw_outbegin(format, W_USER);
+	rc = EXIT_SUCCESS;
+	for (i = 0; i < keys->sl_cur; i++) {
+		key = keys->sl_str[i];
+		pwd = pw_id_numeric(key) ? GETPWUID(pw_checkuid(key)) :
+		    GETPWNAM(key);
+		if (pwd == NULL) {
+			if (!force) {
+				warnx("no such user `%s'", key);
+				rc = EX_NOUSER;
+				continue;
+			}
+			pwd = &fakeuser;
+		}
+		show_user(pwd, format, pretty, v7, indexed ? &gi : NULL);
+	}
+	if (format != PWOUT_NONE)
+		pw_outend();
+	if (indexed)
+		grindex_free(&gi);
+	sl_free(keys, 1);
+	return (rc);
 }
 
 int
 pw_user_show(int argc, char **argv, char *arg1)
 {
 	struct passwd *pwd = NULL;
+	struct grindex gi;
+	struct pwquery *q = NULL;
+	StringList *keys = NULL;
 	char *name = NULL;
 	intmax_t id = -1;
-	int ch;
+	int ch, format = PWOUT_NONE;
 	bool all = false;
 	bool pretty = false;
 	bool force = false;
 	bool v7 = false;
 	bool quiet = false;
+	bool indexed = false;
+	bool raw;
 
 	if (arg1 != NULL) {
 		if (pw_id_numeric(arg1))
 			id = pw_checkuid(arg1);
 		else
 			name = arg1;
+		pw_addkey(&keys, arg1);
 	}
 
-	while ((ch = getopt(argc, argv, "C:qn:u:FPa7")) != -1) {
+	while ((ch = getopt(argc, argv, "C:qn:u:FPa7o:w:s:l:")) != -1 ||
+	    optind < argc) {
 		switch (ch) {
+		case -1:
+			pw_addkey(&keys, argv[optind++]);
+			break;
 		case 'C':
 			/* ignore compatibility */
 			break;
@@ -835,9 +1240,11 @@ pw_user_show(int argc, char **argv, char *arg1)
 			break;
 		case 'n':
 			name = optarg;
+			pw_addkey(&keys, optarg);
 			break;
 		case 'u':
 			id = pw_checkuid(optarg);
+			pw_addkey(&keys, optarg);
 			break;
 		case 'F':
 			force = true;
@@ -851,26 +1258,76 @@ pw_user_show(int argc, char **argv, char *arg1)
 		case '7':
 			v7 = true;
 			break;
+		case 'o':
+			if ((format = pw_outformat(optarg)) == -1)
+				errx(EX_USAGE, "unknown output format `%s'",
+				    optarg);
+			break;
+		case 'w':
+		case 's':
+		case 'l':
+			if (q == NULL)
+				q = pw_query_new(W_USER);
+			if (ch == 'w')
+				pw_query_where(q, optarg);
+			else if (ch == 's')
+				pw_query_sort(q, optarg);
+			else
+				pw_query_limit(q, optarg);
+			break;
 		default:
 			usage();
 		}
 	}
-	argc -= optind;
-	argv += optind;
-	if (argc > 0)
-		usage();
+	if (format != PWOUT_NONE && (pretty || v7))
+		errx(EX_USAGE, "-o cannot be combined with -P or -7");
+	if (q != NULL) {
+		if (keys != NULL)
+			errx(EX_USAGE, "-w, -s and -l select from all users");
+		all = true;
+	}
 
 	if (quiet)
 		freopen(_PATH_DEVNULL, "w", stderr);
 
 	if (all) {
-		SETPWENT();
-		while ((pwd = GETPWENT()) != NULL)
-			print_user(pwd, pretty, v7);
-		ENDPWENT();
+		/*
+		 * Plain records of the file itself, with nothing pending
+		 * over it, print as they are
+		 */
+		raw = format == PWOUT_NONE && !pretty && !v7 && q == NULL &&
+		    PWALTDIR() != PWF_REGULAR && pw_txclean(PWTX_PW);
+		if (pretty || format != PWOUT_NONE ||
+		    (q != NULL && pw_query_needgroups(q))) {
+			grindex_build(&gi);
+			indexed = true;
+		}
+		if (format != PWOUT_NONE)
+			pw_outbegin(format, W_USER);
+		if (raw)
+			fflush(stdout);
+		if (q != NULL)
+			show_query(q, format, pretty, v7,
+			    indexed ? &gi : NULL);
+		else if (!raw || !vdumppwent(STDOUT_FILENO)) {
+			SETPWENT();
+			while ((pwd = GETPWENT()) != NULL)
+				show_user(pwd, format, pretty, v7,
+				    indexed ? &gi : NULL);
+			ENDPWENT();
+		}
+		if (format != PWOUT_NONE)
+			pw_outend();
+		if (indexed)
+			grindex_free(&gi);
+		pw_query_free(q);
+		sl_free(keys, 1);
 		return (EXIT_SUCCESS);
 	}
 
+	if (keys != NULL && (keys->sl_cur != 1 || (id < 0 && name == NULL)))
+		return (show_keys(keys, format, pretty, v7, force));
+	sl_free(keys, 1);
 	if (id < 0 && name == NULL)
 		errx(EX_DATAERR, "username or id required");
 
@@ -885,7 +1342,16 @@ pw_user_show(int argc, char **argv, char *arg1)
 		}
 	}
 
-	return (print_user(pwd, pretty, v7));
+	if (format != PWOUT_NONE) {
+		grindex_build(&gi);
+		pw_outbegin(format, W_USER);
+		show_user(pwd, format, pretty, v7, &gi);
+		pw_outend();
+		grindex_free(&gi);
+		return (EXIT_SUCCESS);
+	}
+
+	return (print_user(pwd, pretty, v7, NULL));
 }
 
 int
@@ -1047,24 +1513,9 @@ pw_user_del(int argc, char **argv, char *arg1)
 	    (grp->gr_mem == NULL || *grp->gr_mem == NULL) &&
 	    strcmp(name, grname) == 0)
 		delgrent(GETGRNAM(name));
-	SETGRENT();
-	while ((grp = GETGRENT()) != NULL) {
-		int i, j;
-		char group[MAXLOGNAME];
-		if (grp->gr_mem == NULL)
-			continue;
-
-		for (i = 0; grp->gr_mem[i] != NULL; i++) {
-			if (strcmp(grp->gr_mem[i], name) != 0)
-				continue;
-
-			for (j = i; grp->gr_mem[j] != NULL; j++)
-				grp->gr_mem[j] = grp->gr_mem[j+1];
-			strlcpy(group, grp->gr_name, MAXLOGNAME);
-			chggrent(group, grp);
-		}
-	}
-	ENDGRENT();
+	chggrmembers(name, NULL, NULL, true);
+	if (pw_txcommit() == -1)
+		err(EX_IOERR, "passwd update");
 
 	pw_log(cnf, M_DELETE, W_USER, "%s(%" PW_UID_PRI ") account removed",
 	    name, PW_UID_ARG((uid_t)id));
@@ -1183,6 +1634,196 @@ validate_grname(struct userconf *cnf, char *group)
 	cnf->default_group = newstr(grp->gr_name);
 }
 
+/*
+ * A group named on the command line, by name or by gid.  Groups are
+ * offered to it one at a time; one with that name wins over one with
+ * that gid, as when GETGRNAM() is tried before GETGRGID().
+ */
+struct grwant {
+	char		*key;
+	intmax_t	 id;		/* key as a gid, or -1 */
+	char		*name;		/* the group found, or NULL */
+	gid_t		 gid;
+	bool		 byname;
+};
+
+/*
+ * What useradd needs from the databases, gathered by useradd_plan()
+ * before anything is written and only read from then on, so that -N
+ * prints what the commit would write.
+ */
+struct addplan {
+	uid_t		 uid;
+	gid_t		 gid;
+	bool		 newgroup;	/* gid is for a group of the user's own */
+	StringList	*groups;	/* other groups to join, by name */
+};
+
+static void
+grwant_init(struct grwant *w, char *key, bool numeric)
+{
+
+	w->key = key;
+	w->id = numeric && pw_id_numeric(key) ? pw_checkgid(key) : -1;
+	w->name = NULL;
+	w->gid = (gid_t)-1;
+	w->byname = false;
+}
+
+static void
+grwant_offer(struct grwant *w, const struct group *grp)
+{
+
+	if (grp == NULL || w->byname)
+		return;
+	if (strcmp(grp->gr_name, w->key) == 0) {
+		free(w->name);
+		w->byname = true;
+	} else if (w->name != NULL || w->id < 0 ||
+	    grp->gr_gid != (gid_t)w->id)
+		return;
+	w->name = newstr(grp->gr_name);
+	w->gid = grp->gr_gid;
+}
+
+/*
+ * Find out all that adding user name needs to know of the databases:
+ * the groups given by -g (grname) and -G (gkeys), or failing grname
+ * whether a group of the user's own exists already, whether the name
+ * or uid id is taken and, where ids are to be chosen, the ids in use.
+ * Each file is walked once at most, and only when the ids in use are
+ * not known already; otherwise the few records wanted are looked up.
+ */
+static void
+useradd_plan(struct addplan *plan, struct userconf *cmdcnf,
+    struct userconf *cnf, char *name, intmax_t id, char *grname,
+    StringList *gkeys)
+{
+	struct passwd	*pwd;
+	struct group	*grp;
+	struct grwant	*want;
+	struct bitmap	 ubm, gbm;
+	char		*str;
+	size_t		 i, n;
+	bool		 nametaken, uidtaken, preferused;
+
+	/*
+	 * The group file: want[0] is the primary group, the others those
+	 * to join
+	 */
+	n = 1 + (gkeys != NULL ? gkeys->sl_cur : 0);
+	if ((want = calloc(n, sizeof(*want))) == NULL)
+		err(EX_OSERR, "calloc()");
+	grwant_init(&want[0], grname != NULL ? grname : name, grname != NULL);
+	for (i = 1; i < n; i++)
+		grwant_init(&want[i], gkeys->sl_str[i - 1], true);
+	preferused = false;
+	if (grname == NULL && !pw_gidknown(cnf, &gbm)) {
+		SETGRENT();
+		while ((grp = GETGRENT()) != NULL) {
+			for (i = 0; i < n; i++)
+				grwant_offer(&want[i], grp);
+			if (id >= 0 && grp->gr_gid == (gid_t)id)
+				preferused = true;
+			if ((gid_t)grp->gr_gid >= (gid_t)cnf->min_gid &&
+			    (gid_t)grp->gr_gid <= (gid_t)cnf->max_gid)
+				bm_setbit(&gbm, grp->gr_gid - cnf->min_gid);
+		}
+		ENDGRENT();
+		pw_gidscanned(cnf, &gbm);
+	} else {
+		for (i = 0; i < n; i++) {
+			grwant_offer(&want[i], GETGRNAM(want[i].key));
+			if (want[i].id >= 0)
+				grwant_offer(&want[i],
+				    GETGRGID((gid_t)want[i].id));
+		}
+		if (grname == NULL && id >= 0)
+			preferused = GETGRGID((gid_t)id) != NULL;
+	}
+	for (i = grname != NULL ? 0 : 1; i < n; i++)
+		if (want[i].name == NULL)
+			errx(EX_NOUSER, "group `%s' does not exist",
+			    want[i].key);
+
+	/*
+	 * The password file
+	 */
+	nametaken = uidtaken = false;
+	if (id < 0 && !pw_uidknown(cmdcnf, &ubm)) {
+		SETPWENT();
+		while ((pwd = GETPWENT()) != NULL) {
+			if (strcmp(pwd->pw_name, name) == 0)
+				nametaken = true;
+			if (pwd->pw_uid >= (uid_t) cmdcnf->min_uid &&
+			    pwd->pw_uid <= (uid_t) cmdcnf->max_uid)
+				bm_setbit(&ubm, pwd->pw_uid - cmdcnf->min_uid);
+		}
+		ENDPWENT();
+		pw_uidscanned(cmdcnf, &ubm);
+	} else {
+		nametaken = GETPWNAM(name) != NULL;
+		uidtaken = id >= 0 && conf.checkduplicate &&
+		    GETPWUID((uid_t)id) != NULL;
+	}
+	if (nametaken)
+		errx(EX_DATAERR, "login name `%s' already exists", name);
+	if (uidtaken)
+		errx(EX_DATAERR,
+		    "uid `%" PW_UID_PRI "' has already been allocated",
+		    PW_UID_ARG((uid_t)id));
+
+	/*
+	 * Now choose the ids.  A new group of the user's own gets the
+	 * uid as its gid if that is free, so the two match.
+	 */
+	if (id < 0)
+		ids_reserved(IDS_UID, cmdcnf->min_uid, &ubm);
+	if (grname == NULL)
+		ids_reserved(IDS_GID, cnf->min_gid, &gbm);
+	plan->newgroup = want[0].name == NULL;
+	if (plan->newgroup && id < 0)
+		plan->uid = pw_idtake(cmdcnf, cnf, &ubm, &gbm, &plan->gid);
+	else {
+		plan->uid = id >= 0 ? (uid_t)id : pw_uidtake(cmdcnf, &ubm);
+		if (!plan->newgroup)
+			plan->gid = want[0].gid;
+		else if (!preferused)
+			plan->gid = (gid_t)id;
+		else
+			plan->gid = pw_gidtake(cnf, &gbm, -1);
+	}
+	if (id < 0)
+		bm_dealloc(&ubm);
+	if (grname == NULL)
+		bm_dealloc(&gbm);
+
+	plan->groups = NULL;
+	if (gkeys != NULL) {
+		plan->groups = sl_init();
+		for (i = 1; i < n; i++)
+			sl_add(plan->groups, want[i].name);
+	} else if (cmdcnf->groups != NULL) {
+		plan->groups = sl_init();
+		for (i = 0; i < cmdcnf->groups->sl_cur; i++) {
+			if ((str = strdup(cmdcnf->groups->sl_str[i])) == NULL)
+				err(EX_OSERR, "strdup()");
+			sl_add(plan->groups, str);
+		}
+	}
+	free(want[0].name);
+	free(want);
+}
+
+static void
+useradd_planfree(struct addplan *plan)
+{
+
+	if (plan->groups != NULL)
+		sl_free(plan->groups, 1);
+	plan->groups = NULL;
+}
+
 static mode_t
 validate_mode(char *mode)
 {
@@ -1216,6 +1857,8 @@ mix_config(struct userconf *cmdcnf, struct userconf *cfg)
 		cmdcnf->reuse_uids = cfg->reuse_uids;
 	if (cmdcnf->reuse_gids == 0)
 		cmdcnf->reuse_gids = cfg->reuse_gids;
+	if (cmdcnf->idstate == 0)
+		cmdcnf->idstate = cfg->idstate;
 	if (cmdcnf->nispasswd == NULL)
 		cmdcnf->nispasswd = cfg->nispasswd;
 	if (cmdcnf->dotdir == NULL)
@@ -1260,7 +1903,9 @@ pw_user_add(int argc, char **argv, char *arg1)
 	struct userconf *cnf, *cmdcnf;
 	struct passwd *pwd;
 	struct group *grp;
+	struct addplan plan;
 	struct stat st;
+	StringList *gkeys;
 	char args[] = "C:qn:u:c:d:e:p:g:G:mM:k:s:oL:i:w:h:H:Db:NPy:Y";
 	char line[_PASSWORD_LEN+1], path[MAXPATHLEN];
 	char *gecos, *homedir, *skel, *walk, *userid, *groupid, *grname;
@@ -1272,14 +1917,15 @@ pw_user_add(int argc, char **argv, char *arg1)
 	FILE *pfp, *fp;
 	intmax_t id = -1;
 	time_t now;
-	int rc, ch, fd = -1;
 	size_t i;
+	int rc, ch, fd = -1;
 	bool dryrun, nis, pretty, quiet, createhome, precrypted, genconf;
 
 	dryrun = nis = pretty = quiet = createhome = precrypted = false;
 	genconf = false;
 	gecos = homedir = skel = userid = groupid = default_passwd = NULL;
 	grname = name = NULL;
+	gkeys = NULL;
 
 	if ((cmdcnf = calloc(1, sizeof(struct userconf))) == NULL)
 		err(EXIT_FAILURE, "calloc()");
@@ -1327,11 +1973,14 @@ pw_user_add(int argc, char **argv, char *arg1)
 			    cmdcnf->password_days = parse_date(now, optarg);
 			break;
 		case 'g':
-			validate_grname(cmdcnf, optarg);
 			grname = optarg;
 			break;
 		case 'G':
-			split_groups(&cmdcnf->groups, optarg);
+			if (gkeys == NULL)
+				gkeys = sl_init();
+			for (p = strtok(optarg, ", \t"); p != NULL;
+			    p = strtok(NULL, ", \t"))
+				sl_add(gkeys, p);
 			break;
 		case 'm':
 			createhome = true;
@@ -1416,6 +2065,12 @@ pw_user_add(int argc, char **argv, char *arg1)
 
 	cnf = get_userconfig(cfg);
 
+	if (genconf) {
+		if (grname != NULL)
+			validate_grname(cmdcnf, grname);
+		for (i = 0; gkeys != NULL && i < gkeys->sl_cur; i++)
+			split_groups(&cmdcnf->groups, gkeys->sl_str[i]);
+	}
 	mix_config(cmdcnf, cnf);
 	if (default_passwd)
 		cmdcnf->default_password = passwd_val(default_passwd,
@@ -1456,18 +2111,16 @@ pw_user_add(int argc, char **argv, char *arg1)
 	if (name == NULL)
 		errx(EX_DATAERR, "login name required");
 
-	if (GETPWNAM(name) != NULL)
-		errx(EX_DATAERR, "login name `%s' already exists", name);
-
 	if (!grname)
 		grname = cmdcnf->default_group;
 
+	useradd_plan(&plan, cmdcnf, cnf, name, id, grname, gkeys);
+
 	pwd = &fakeuser;
 	pwd->pw_name = name;
 	pwd->pw_class = cmdcnf->default_class ? cmdcnf->default_class : "";
-	pwd->pw_uid = pw_uidpolicy(cmdcnf, id);
-	pwd->pw_gid = pw_gidpolicy(cnf, grname, pwd->pw_name,
-	    (gid_t) pwd->pw_uid, dryrun);
+	pwd->pw_uid = plan.uid;
+	pwd->pw_gid = plan.gid;
 
 	/* cmdcnf->password_days and cmdcnf->expire_days hold unixtime here */
 	if (cmdcnf->password_days > 0)
@@ -1495,9 +2148,14 @@ pw_user_add(int argc, char **argv, char *arg1)
 	if (fd != -1)
 		pw_set_passwd(pwd, fd, precrypted, false);
 
-	if (dryrun)
-		return (print_user(pwd, pretty, false));
+	if (dryrun) {
+		useradd_planfree(&plan);
+		return (print_user(pwd, pretty, false, NULL));
+	}
 
+	if (plan.newgroup)
+		groupadd(cnf, pwd->pw_name, pwd->pw_gid, NULL, -1, false,
+		    false, false);
 	if ((rc = addpwent(pwd)) != 0) {
 		if (rc == -1)
 			errx(EX_IOERR, "user '%s' already exists",
@@ -1516,25 +2174,11 @@ pw_user_add(int argc, char **argv, char *arg1)
 		/* NOTE: we treat NIS-only update errors as non-fatal */
 	}
 
-	if (cmdcnf->groups != NULL) {
-		for (i = 0; i < cmdcnf->groups->sl_cur; i++) {
-			grp = GETGRNAM(cmdcnf->groups->sl_str[i]);
-			/* gr_add doesn't check if new member is already in group */
-			if (grp_has_member(grp, pwd->pw_name))
-				continue;
-			grp = gr_add(grp, pwd->pw_name);
-			/*
-			 * grp can only be NULL in 2 cases:
-			 * - the new member is already a member
-			 * - a problem with memory occurs
-			 * in both cases we want to skip now.
-			 */
-			if (grp == NULL)
-				continue;
-			chggrent(grp->gr_name, grp);
-			free(grp);
-		}
-	}
+	if (plan.groups != NULL)
+		chggrmembers(pwd->pw_name, pwd->pw_name, plan.groups, false);
+	useradd_planfree(&plan);
+	if (pw_txcommit() == -1)
+		err(EX_IOERR, "passwd update");
 
 	pwd = GETPWNAM(name);
 	if (pwd == NULL)
@@ -1613,7 +2257,6 @@ pw_user_mod(int argc, char **argv, char *arg1)
 	struct stat st;
 	intmax_t id = -1;
 	int ch, fd = -1;
-	size_t i, j;
 	bool quiet, createhome, pretty, dryrun, nis, edited;
 	bool precrypted;
 	mode_t homemode = 0;
@@ -1862,54 +2505,21 @@ pw_user_mod(int argc, char **argv, char *arg1)
 		edited = pw_set_passwd(pwd, fd, precrypted, true);
 
 	if (dryrun)
-		return (print_user(pwd, pretty, false));
+		return (print_user(pwd, pretty, false, NULL));
 
 	if (edited) /* Only updated this if required */
 		perform_chgpwent(name, pwd, nis ? nispasswd : NULL);
-	/* Now perform the needed changes concern groups */
-	if (groups != NULL) {
-		/* Delete User from groups using old name */
-		SETGRENT();
-		while ((grp = GETGRENT()) != NULL) {
-			if (grp->gr_mem == NULL)
-				continue;
-			for (i = 0; grp->gr_mem[i] != NULL; i++) {
-				if (strcmp(grp->gr_mem[i] , name) != 0)
-					continue;
-				for (j = i; grp->gr_mem[j] != NULL ; j++)
-					grp->gr_mem[j] = grp->gr_mem[j+1];
-				chggrent(grp->gr_name, grp);
-				break;
-			}
-		}
-		ENDGRENT();
-		/* Add the user to the needed groups */
-		for (i = 0; i < groups->sl_cur; i++) {
-			grp = GETGRNAM(groups->sl_str[i]);
-			grp = gr_add(grp, pwd->pw_name);
-			if (grp == NULL)
-				continue;
-			chggrent(grp->gr_name, grp);
-			free(grp);
-		}
-	}
-	/* In case of rename we need to walk over the different groups */
-	if (newname) {
-		SETGRENT();
-		while ((grp = GETGRENT()) != NULL) {
-			if (grp->gr_mem == NULL)
-				continue;
-			for (i = 0; grp->gr_mem[i] != NULL; i++) {
-				if (strcmp(grp->gr_mem[i], name) != 0)
-					continue;
-				grp->gr_mem[i] = newname;
-				chggrent(grp->gr_name, grp);
-				break;
-			}
-		}
-	}
+	/*
+	 * Now perform the needed changes concern groups: -G sets the
+	 * user's groups, and a rename follows it into the others
+	 */
+	if (groups != NULL || newname != NULL)
+		chggrmembers(name, newname != NULL ? newname : name, groups,
+		    groups != NULL);
+	if (pw_txcommit() == -1)
+		err(EX_IOERR, "passwd update");
 
-	/* go get a current version of pwd */
+	/* go get a current version of pwd, as committed (from memory) */
 	if (newname)
 		name = newname;
 	pwd = GETPWNAM(name);
@@ -91,6 +91,39 @@ pw_id_numeric(const char *nptr)
 	return (true);
 }
 
+/*
+ * Add a name or id to those a show command is to look up; "-" adds
+ * those on standard input, one per line.
+ */
+void
+pw_addkey(StringList **keys, const char *key)
+{
+	char *line, *p;
+	size_t linecap;
+	ssize_t len;
+
+	if (*keys == NULL && (*keys = sl_init()) == NULL)
+		err(EX_OSERR, "sl_init()");
+	if (strcmp(key, "-") != 0) {
+		if ((p = strdup(key)) == NULL || sl_add(*keys, p) == -1)
+			err(EX_OSERR, "strdup()");
+		return;
+	}
+	line = NULL;
+	linecap = 0;
+	while ((len = getline(&line, &linecap, stdin)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len == 0)
+			continue;
+		if ((p = strdup(line)) == NULL || sl_add(*keys, p) == -1)
+			err(EX_OSERR, "strdup()");
+	}
+	free(line);
+	if (ferror(stdin))
+		err(EX_IOERR, "stdin");
+}
+
 intmax_t
 pw_checkuid(char *nptr)
 {
@@ -142,15 +175,41 @@ get_userconfig(const char *config)
 	return (read_userconfig(defaultcfg));
 }
 
+/* NIS maps need rebuilding once the files are committed */
+static bool nisdirty;
+
+/*
+ * Note that the NIS maps are to be rebuilt.  That is left to
+ * nis_flush(), once the changes are committed, so that a batch of
+ * commands rebuilds them only once.
+ */
 int
 nis_update(void) {
-	pid_t pid;
-	int i;
 
 	if (access(_PATH_YP_MAKEFILE, F_OK) != 0)
 		errx(EX_UNAVAILABLE, "NIS update requested but '%s' is missing",
 		    _PATH_YP_MAKEFILE);
+	nisdirty = true;
+	return (0);
+}
+
+bool
+nis_pending(void)
+{
+	return (nisdirty);
+}
+
+/*
+ * Rebuild the NIS maps if any command asked for it.
+ */
+int
+nis_flush(void) {
+	pid_t pid;
+	int i;
 
+	if (!nisdirty)
+		return (0);
+	nisdirty = false;
 	fflush(NULL);
 	if ((pid = fork()) == -1) {
 		warn("fork()");
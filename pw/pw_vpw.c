@@ -27,28 +27,671 @@
  *
  */
 
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
 #include <pwd.h>
 #include <grp.h>
+#include <fcntl.h>
 #include <libutil.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <err.h>
+#include <errno.h>
 #include <unistd.h>
 
 #include "pwupd.h"
 
-static FILE * pwd_fp = NULL;
+/*
+ * The alternate backend maps the whole database read-only and walks it
+ * record by record.  Lookups compare the key straight from the raw
+ * record (the name up to the first ':', or the third field as a
+ * number); a struct passwd/group is only built (by pw_scan()/gr_scan())
+ * for the record that is actually handed back to the caller.
+ */
+struct vpwfile {
+	char		*base;		/* mapped contents */
+	size_t		 size;
+	size_t		 off;		/* enumeration cursor */
+	bool		 open;
+};
+
+struct vpwrec {
+	const char	*line;
+	size_t		 len;
+};
+
+static char *vpw_line = NULL;
+static size_t vpw_linecap = 0;
+
+static bool
+vpw_open(struct vpwfile *vf, const char *path, struct stat *stp)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	if (stp == NULL)
+		stp = &st;
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return (false);
+	if (fstat(fd, stp) == -1) {
+		close(fd);
+		return (false);
+	}
+	vf->base = NULL;
+	vf->size = stp->st_size;
+	vf->off = 0;
+	if (vf->size > 0) {
+		p = mmap(NULL, vf->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			close(fd);
+			return (false);
+		}
+		vf->base = p;
+	}
+	close(fd);
+	vf->open = true;
+	return (true);
+}
+
+static void
+vpw_close(struct vpwfile *vf)
+{
+	if (vf->open && vf->base != NULL)
+		munmap(vf->base, vf->size);
+	vf->base = NULL;
+	vf->size = vf->off = 0;
+	vf->open = false;
+}
+
+/*
+ * Advance to the next record, skipping comments and empty lines.
+ */
+static bool
+vpw_nextrec(struct vpwfile *vf, struct vpwrec *rec)
+{
+	const char *p, *end, *nl;
+	size_t len;
+
+	while (vf->off < vf->size) {
+		p = vf->base + vf->off;
+		end = vf->base + vf->size;
+		nl = memchr(p, '\n', end - p);
+		len = (nl != NULL ? nl : end) - p;
+		vf->off += len + (nl != NULL);
+		/* Skip comments and empty lines */
+		if (len == 0 || *p == '#')
+			continue;
+		rec->line = p;
+		rec->len = len;
+		return (true);
+	}
+	return (false);
+}
+
+/*
+ * Copy a record out of the map so it can be handed to the libutil
+ * scanners, which expect a NUL terminated line.
+ */
+static char *
+vpw_cstr(const struct vpwrec *rec)
+{
+	char *p;
+
+	if (rec->len + 1 > vpw_linecap) {
+		if ((p = realloc(vpw_line, rec->len + 1)) == NULL)
+			err(EXIT_FAILURE, "realloc()");
+		vpw_line = p;
+		vpw_linecap = rec->len + 1;
+	}
+	memcpy(vpw_line, rec->line, rec->len);
+	vpw_line[rec->len] = '\0';
+	return (vpw_line);
+}
+
+/*
+ * Length of the name field of a record.
+ */
+static size_t
+vpw_keylen(const struct vpwrec *rec)
+{
+	const char *c;
+
+	c = memchr(rec->line, ':', rec->len);
+	return (c != NULL ? (size_t)(c - rec->line) : rec->len);
+}
+
+static bool
+vpw_keyeq(const struct vpwrec *rec, const char *nam)
+{
+	size_t len = strlen(nam);
+
+	return (rec->len > len && rec->line[len] == ':' &&
+	    memcmp(rec->line, nam, len) == 0);
+}
+
+/*
+ * Parse the id field of a record without touching the rest of it.
+ * Anything but a plain decimal number is left to the full scanner so
+ * that odd entries keep the exact pw_scan()/gr_scan() semantics.
+ */
+static bool
+vpw_keyid(const struct vpwrec *rec, uintmax_t *id)
+{
+	const char *p, *end;
+	uintmax_t v;
+	int i;
+
+	p = rec->line;
+	end = p + rec->len;
+	for (i = 0; i < 2; i++) {
+		if ((p = memchr(p, ':', end - p)) == NULL)
+			return (false);
+		p++;
+	}
+	if (p == end || *p == ':')
+		return (false);
+	for (v = 0, i = 0; p < end && *p != ':'; p++, i++) {
+		if (*p < '0' || *p > '9' || i == 10)
+			return (false);
+		v = v * 10 + (*p - '0');
+	}
+	if (v > UINT32_MAX)
+		return (false);
+	*id = v;
+	return (true);
+}
+
+static void
+vpw_write(int fd, const char *p, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "write()");
+		}
+		p += n;
+		len -= n;
+	}
+}
+
+/*
+ * Whether a number is written as pw_make()/gr_make() would write it
+ * back: plain decimal, no leading zeros, and within 32 bits.
+ */
+static bool
+vpw_plainnum(const char *p, const char *end)
+{
+	uintmax_t v;
+
+	if (p == end || end - p > 10 || (*p == '0' && end - p > 1))
+		return (false);
+	for (v = 0; p < end; p++) {
+		if (*p < '0' || *p > '9')
+			return (false);
+		v = v * 10 + (*p - '0');
+	}
+	return (v <= UINT32_MAX);
+}
+
+/*
+ * Whether a record reads back unchanged through the scanner and the
+ * maker: nfields fields, those in the numeric mask plain numbers, and
+ * with members, a last field without empty names.  NIS +/- entries
+ * are always left to the scanner.
+ */
+static bool
+vpw_canonical(const struct vpwrec *rec, int nfields, unsigned numeric,
+    bool members)
+{
+	const char *p, *end, *f;
+	int i;
+
+	p = rec->line;
+	end = p + rec->len;
+	if (*p == '+' || *p == '-')
+		return (false);
+	for (i = 0; i < nfields - 1; i++) {
+		if ((f = memchr(p, ':', end - p)) == NULL)
+			return (false);
+		if ((numeric & (1U << i)) != 0 && !vpw_plainnum(p, f))
+			return (false);
+		p = f + 1;
+	}
+	/* p is the last field */
+	if (memchr(p, ':', end - p) != NULL)
+		return (false);
+	if (members && p < end && (*p == ',' || end[-1] == ',' ||
+	    memmem(p, end - p, ",,", 2) != NULL))
+		return (false);
+	return (true);
+}
+
+/*
+ * Write every record of an open database to fd, as enumerating it and
+ * printing each with pw_make() or gr_make() would.  Each record is
+ * still scanned, so that an invalid one is an error as it is then, but
+ * runs of records already in that form go straight from the map; only
+ * the rest are made again: remake() scans each record, and returns it
+ * made again unless told it is canonical.
+ */
+static void
+vpw_dump(struct vpwfile *vf, int fd, int nfields, unsigned numeric,
+    bool members, char *(*remake)(const struct vpwrec *, bool))
+{
+	struct vpwrec rec;
+	const char *run, *end;
+	char *line;
+	bool canon;
+
+	run = end = NULL;
+	while (vpw_nextrec(vf, &rec)) {
+		canon = vpw_canonical(&rec, nfields, numeric, members);
+		line = remake(&rec, canon);
+		if (canon) {
+			if (rec.line != end) {
+				if (run != NULL)
+					vpw_write(fd, run, end - run);
+				run = rec.line;
+			}
+			end = rec.line + rec.len;
+			if (end < vf->base + vf->size)
+				end++;		/* its newline */
+			continue;
+		}
+		if (run != NULL)
+			vpw_write(fd, run, end - run);
+		run = end = NULL;
+		vpw_write(fd, line, strlen(line));
+		vpw_write(fd, "\n", 1);
+		free(line);
+	}
+	if (run != NULL) {
+		vpw_write(fd, run, end - run);
+		if (end[-1] != '\n')
+			vpw_write(fd, "\n", 1);
+	}
+}
+
+/*
+ * Per-process index of a database file: name and id to record offset.
+ * It is built by a single pass over the mapped file the first time a
+ * keyed lookup is made, and keeps the mapping alive.  The index is
+ * tied to the identity of the file it was built from, so once
+ * pw_update()/gr_update() install a new file it is rebuilt on the next
+ * lookup.  As with the linear scan, the first record wins for
+ * duplicate names or ids.
+ *
+ * The same tables are saved next to the database by the commit path
+ * (see vpwidxupdate()) so that later processes can use them without
+ * parsing the file at all.  The sidecar holds a header followed by the
+ * name and id tables and is only trusted while the size, mtime and
+ * edge hash of the database match what it was built from; otherwise
+ * the database is scanned as usual.
+ */
+#define VPW_IDXSUFFIX	".pwidx"
+#define VPW_IDXMAGIC	"PWIDX\0\0\1"
+#define VPW_IDXEDGE	4096
+
+struct vpwslot {
+	uint64_t	 off;		/* record offset + 1, 0 if empty */
+	uint32_t	 key;		/* name hash or id */
+	uint32_t	 spare;
+};
+
+struct vpwidxhdr {
+	char		 magic[8];
+	uint64_t	 size;		/* database size */
+	int64_t		 mtime;		/* database mtime */
+	int64_t		 mtimensec;
+	uint64_t	 hash;		/* hash of the first and last page */
+	uint64_t	 nslots;	/* slots per table */
+};
+
+struct vpwidx {
+	struct vpwfile	 vf;
+	dev_t		 dev;
+	ino_t		 ino;
+	off_t		 size;
+	struct timespec	 mtim;
+	size_t		 mask;
+	struct vpwslot	*byname;
+	struct vpwslot	*byid;
+	void		*side;		/* mapped sidecar, if tables live there */
+	size_t		 sidesize;
+};
+
+typedef bool (*vpw_keyid_t)(const struct vpwrec *, uintmax_t *);
+
+static uint32_t
+vpw_hash(const char *p, size_t len)
+{
+	uint32_t h = 2166136261U;
+
+	while (len-- > 0) {
+		h ^= (unsigned char)*p++;
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+static size_t
+vpw_idhash(uint32_t id)
+{
+	return ((size_t)(id * 2654435761U));
+}
+
+/*
+ * Cheap fingerprint of a database: a hash of its first and last page.
+ * Together with the size and mtime this catches a file that was edited
+ * in place behind our back without reading all of it.
+ */
+static uint64_t
+vpw_edgehash(const struct vpwfile *vf)
+{
+	const unsigned char *p;
+	uint64_t h = 14695981039346656037ULL;
+	size_t i, n, tail;
+
+	n = MIN(vf->size, VPW_IDXEDGE);
+	tail = vf->size - n;
+	p = (const unsigned char *)vf->base;
+	for (i = 0; i < n; i++)
+		h = (h ^ p[i]) * 1099511628211ULL;
+	for (i = MAX(tail, n); i < vf->size; i++)
+		h = (h ^ p[i]) * 1099511628211ULL;
+	return (h);
+}
+
+static void
+vpw_idx_drop(struct vpwidx *ix)
+{
+	vpw_close(&ix->vf);
+	if (ix->side != NULL)
+		munmap(ix->side, ix->sidesize);
+	else {
+		free(ix->byname);
+		free(ix->byid);
+	}
+	ix->side = NULL;
+	ix->sidesize = 0;
+	ix->byname = ix->byid = NULL;
+	ix->mask = 0;
+}
+
+static void
+vpw_idx_setid(struct vpwidx *ix, const struct stat *st)
+{
+	ix->dev = st->st_dev;
+	ix->ino = st->st_ino;
+	ix->size = st->st_size;
+	ix->mtim = st->st_mtim;
+}
+
+static bool
+vpw_idx_fresh(const struct vpwidx *ix, const struct stat *st)
+{
+	return (ix->vf.open && ix->dev == st->st_dev &&
+	    ix->ino == st->st_ino && ix->size == st->st_size &&
+	    ix->mtim.tv_sec == st->st_mtim.tv_sec &&
+	    ix->mtim.tv_nsec == st->st_mtim.tv_nsec);
+}
+
+static void
+vpw_idx_insert(struct vpwslot *tab, size_t mask, size_t h, uint32_t key,
+    size_t off)
+{
+	for (h &= mask; tab[h].off != 0; h = (h + 1) & mask)
+		;
+	tab[h].off = off + 1;
+	tab[h].key = key;
+}
+
+static bool
+vpw_idx_build(struct vpwidx *ix, const char *path, vpw_keyid_t keyid)
+{
+	struct vpwrec rec;
+	struct stat st;
+	const char *p, *end;
+	size_t n, off;
+	uintmax_t id;
+	uint32_t h;
+
+	vpw_idx_drop(ix);
+	if (!vpw_open(&ix->vf, path, &st))
+		return (false);
+	vpw_idx_setid(ix, &st);
+
+	/* Size the tables for at most half occupancy */
+	n = 1;
+	p = ix->vf.base;
+	end = p + ix->vf.size;
+	while (p != NULL && p < end &&
+	    (p = memchr(p, '\n', end - p)) != NULL) {
+		p++;
+		n++;
+	}
+	for (ix->mask = 16; ix->mask < n * 2; ix->mask <<= 1)
+		;
+	ix->byname = calloc(ix->mask, sizeof(*ix->byname));
+	ix->byid = calloc(ix->mask, sizeof(*ix->byid));
+	ix->mask--;
+	if (ix->byname == NULL || ix->byid == NULL) {
+		vpw_idx_drop(ix);
+		return (false);
+	}
+
+	while (vpw_nextrec(&ix->vf, &rec)) {
+		off = rec.line - ix->vf.base;
+		h = vpw_hash(rec.line, vpw_keylen(&rec));
+		vpw_idx_insert(ix->byname, ix->mask, h, h, off);
+		if (keyid(&rec, &id))
+			vpw_idx_insert(ix->byid, ix->mask,
+			    vpw_idhash((uint32_t)id), (uint32_t)id, off);
+	}
+	return (true);
+}
+
+static char *
+vpw_idx_path(const char *path)
+{
+	static char pathbuf[MAXPATHLEN];
+
+	snprintf(pathbuf, sizeof pathbuf, "%s" VPW_IDXSUFFIX, path);
+	return (pathbuf);
+}
+
+/*
+ * Use the sidecar of a database, if there is a valid one.  Only the
+ * header and the first and last page of the database are touched here;
+ * the tables are faulted in by the lookups themselves.
+ */
+static bool
+vpw_idx_load(struct vpwidx *ix, const char *path)
+{
+	const struct vpwidxhdr *hdr;
+	struct stat st, sst;
+	void *p;
+	int fd;
+
+	vpw_idx_drop(ix);
+	if ((fd = open(vpw_idx_path(path), O_RDONLY | O_CLOEXEC)) == -1)
+		return (false);
+	if (fstat(fd, &sst) == -1 || (size_t)sst.st_size < sizeof(*hdr) ||
+	    (p = mmap(NULL, sst.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+	    MAP_FAILED) {
+		close(fd);
+		return (false);
+	}
+	close(fd);
+	ix->side = p;
+	ix->sidesize = sst.st_size;
+	hdr = p;
+	if (memcmp(hdr->magic, VPW_IDXMAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->nslots < 16 || (hdr->nslots & (hdr->nslots - 1)) != 0 ||
+	    hdr->nslots > (ix->sidesize - sizeof(*hdr)) /
+	    (2 * sizeof(struct vpwslot)) ||
+	    ix->sidesize != sizeof(*hdr) + 2 * hdr->nslots *
+	    sizeof(struct vpwslot))
+		goto stale;
+	if (!vpw_open(&ix->vf, path, &st))
+		goto stale;
+	if (hdr->size != (uint64_t)st.st_size ||
+	    hdr->mtime != (int64_t)st.st_mtim.tv_sec ||
+	    hdr->mtimensec != (int64_t)st.st_mtim.tv_nsec ||
+	    hdr->hash != vpw_edgehash(&ix->vf))
+		goto stale;
+	vpw_idx_setid(ix, &st);
+	ix->mask = hdr->nslots - 1;
+	ix->byname = (struct vpwslot *)(void *)(hdr + 1);
+	ix->byid = ix->byname + hdr->nslots;
+	return (true);
+stale:
+	vpw_idx_drop(ix);
+	return (false);
+}
+
+/*
+ * Write the tables of a freshly built index next to the database.
+ * The sidecar is only a cache, so failing to write it is not fatal.
+ * It gives away the layout of the database, so it is no more readable
+ * than the database itself.
+ */
+static void
+vpw_idx_save(const struct vpwidx *ix, const char *path)
+{
+	struct vpwidxhdr hdr;
+	struct iovec iov[3];
+	struct stat st;
+	char tmp[MAXPATHLEN];
+	size_t nslots;
+	ssize_t len;
+	int fd;
+
+	nslots = ix->mask + 1;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, VPW_IDXMAGIC, sizeof(hdr.magic));
+	hdr.size = ix->size;
+	hdr.mtime = ix->mtim.tv_sec;
+	hdr.mtimensec = ix->mtim.tv_nsec;
+	hdr.hash = vpw_edgehash(&ix->vf);
+	hdr.nslots = nslots;
+	if (stat(path, &st) == -1)
+		return;
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", vpw_idx_path(path));
+	if ((fd = mkstemp(tmp)) == -1) {
+		warn("%s", tmp);
+		return;
+	}
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = ix->byname;
+	iov[1].iov_len = nslots * sizeof(*ix->byname);
+	iov[2].iov_base = ix->byid;
+	iov[2].iov_len = nslots * sizeof(*ix->byid);
+	len = writev(fd, iov, 3);
+	if (len != (ssize_t)(iov[0].iov_len + iov[1].iov_len +
+	    iov[2].iov_len) || fchmod(fd, st.st_mode & 0777) == -1 || close(fd) == -1) {
+		warn("%s", tmp);
+		unlink(tmp);
+		return;
+	}
+	if (rename(tmp, vpw_idx_path(path)) == -1) {
+		warn("%s", vpw_idx_path(path));
+		unlink(tmp);
+	}
+}
+
+/*
+ * Look a record up by name (nam != NULL) or by id.  Returns false if
+ * the index could not be (re)built, in which case the caller falls
+ * back to a linear scan.  A sidecar found to point at the wrong
+ * records is stale in a way its header did not catch, and is replaced
+ * by an index built from the file.
+ */
+static bool
+vpw_idx_get(struct vpwidx *ix, const char *path, vpw_keyid_t keyid,
+    const char *nam, uint32_t id, struct vpwrec *rec, bool *found)
+{
+	struct vpwfile vf;
+	struct stat st;
+	const struct vpwslot *tab;
+	size_t h, first;
+	uintmax_t recid;
+	uint32_t key;
+	bool stale;
+
+	if (stat(path, &st) == -1) {
+		vpw_idx_drop(ix);
+		*found = false;
+		return (true);
+	}
+	if (!vpw_idx_fresh(ix, &st) && !vpw_idx_load(ix, path) &&
+	    !vpw_idx_build(ix, path, keyid))
+		return (false);
+
+retry:
+	*found = stale = false;
+	if (nam != NULL) {
+		tab = ix->byname;
+		key = vpw_hash(nam, strlen(nam));
+		h = key;
+	} else {
+		tab = ix->byid;
+		key = id;
+		h = vpw_idhash(id);
+	}
+	/*
+	 * Slots for a key are probed in insertion order, i.e. file order,
+	 * so the first hit is the first matching record.  Every hit is
+	 * checked against the record it points at; names only share a
+	 * hash, but an id slot must hold that id.
+	 */
+	for (h &= ix->mask; tab[h].off != 0; h = (h + 1) & ix->mask) {
+		if (tab[h].key != key)
+			continue;
+		first = tab[h].off - 1;
+		vf = ix->vf;
+		vf.off = first;
+		if (!vpw_nextrec(&vf, rec)) {
+			stale = true;
+			continue;
+		}
+		if (nam != NULL && !vpw_keyeq(rec, nam))
+			continue;
+		if (nam == NULL && (!keyid(rec, &recid) || recid != id)) {
+			stale = true;
+			continue;
+		}
+		*found = true;
+		break;
+	}
+	if (stale && ix->side != NULL) {
+		if (!vpw_idx_build(ix, path, keyid))
+			return (false);
+		goto retry;
+	}
+	return (true);
+}
+
+static struct vpwfile pwd_vf;
+static struct vpwidx pwd_idx;
 static int pwd_scanflag;
 static const char *pwd_filename;
 
 void
 vendpwent(void)
 {
-	if (pwd_fp != NULL) {
-		fclose(pwd_fp);
-		pwd_fp = NULL;
-	}
+	vpw_close(&pwd_vf);
 }
 
 void
@@ -58,18 +701,36 @@ vsetpwent(void)
 }
 
 static struct passwd *
-vnextpwent(char const *nam, uid_t uid, int doclose)
+vpw_build(const struct vpwrec *rec)
 {
 	struct passwd *pw;
 	char *line;
-	size_t linecap;
-	ssize_t linelen;
 
-	pw = NULL;
-	line = NULL;
-	linecap = 0;
+	line = vpw_cstr(rec);
+	pw = pw_scan(line, pwd_scanflag);
+	if (pw == NULL)
+		errx(EXIT_FAILURE, "Invalid user entry in '%s':"
+		    " '%s'", getpwpath(pwd_filename), line);
+	return (pw);
+}
 
-	if (pwd_fp == NULL) {
+static bool
+vpw_pwkeyid(const struct vpwrec *rec, uintmax_t *id)
+{
+	struct passwd *pw;
+
+	if (vpw_keyid(rec, id))
+		return (true);
+	pw = vpw_build(rec);
+	*id = pw->pw_uid;
+	free(pw);
+	return (true);
+}
+
+static const char *
+vpw_pwfile(void)
+{
+	if (pwd_filename == NULL) {
 		if (geteuid() == 0) {
 			pwd_filename = _MASTERPASSWD;
 			pwd_scanflag = PWSCAN_MASTER;
@@ -77,36 +738,46 @@ vnextpwent(char const *nam, uid_t uid, int doclose)
 			pwd_filename = _PASSWD;
 			pwd_scanflag = 0;
 		}
-		pwd_fp = fopen(getpwpath(pwd_filename), "r");
 	}
-	 
-	if (pwd_fp != NULL) {
-		while ((linelen = getline(&line, &linecap, pwd_fp)) > 0) {
-			/* Skip comments and empty lines */
-			if (*line == '\n' || *line == '#')
-				continue;
-			/* trim latest \n */
-			if (line[linelen - 1 ] == '\n')
-				line[linelen - 1] = '\0';
-			pw = pw_scan(line, pwd_scanflag);
-			if (pw == NULL)
-				errx(EXIT_FAILURE, "Invalid user entry in '%s':"
-				    " '%s'", getpwpath(pwd_filename), line);
+	return (getpwpath(pwd_filename));
+}
+
+static struct passwd *
+vnextpwent(char const *nam, uid_t uid, int doclose)
+{
+	struct passwd *pw;
+	struct vpwrec rec;
+	uintmax_t id;
+
+	pw = NULL;
+
+	if (!pwd_vf.open)
+		vpw_open(&pwd_vf, vpw_pwfile(), NULL);
+
+	if (pwd_vf.open) {
+		while (vpw_nextrec(&pwd_vf, &rec)) {
 			if (uid != (uid_t)-1) {
-				if (uid == pw->pw_uid)
-					break;
+				if (vpw_keyid(&rec, &id)) {
+					if ((uid_t)id != uid)
+						continue;
+				} else {
+					pw = vpw_build(&rec);
+					if (pw->pw_uid == uid)
+						break;
+					free(pw);
+					pw = NULL;
+					continue;
+				}
 			} else if (nam != NULL) {
-				if (strcmp(nam, pw->pw_name) == 0)
-					break;
-			} else
-				break;
-			free(pw);
-			pw = NULL;
+				if (!vpw_keyeq(&rec, nam))
+					continue;
+			}
+			pw = vpw_build(&rec);
+			break;
 		}
 		if (doclose)
 			vendpwent();
 	}
-	free(line);
 
 	return (pw);
 }
@@ -117,28 +788,81 @@ vgetpwent(void)
   return vnextpwent(NULL, -1, 0);
 }
 
+static struct passwd *
+vlookuppw(char const *nam, uid_t uid)
+{
+	struct vpwrec rec;
+	bool found;
+
+	if (!vpw_idx_get(&pwd_idx, vpw_pwfile(), vpw_pwkeyid, nam, uid,
+	    &rec, &found))
+		return (vnextpwent(nam, uid, 1));
+	return (found ? vpw_build(&rec) : NULL);
+}
+
+/*
+ * Called from the commit path once a new passwd database is in place:
+ * reindex it for this process and leave the tables behind for the next.
+ */
+void
+vpwidxupdate(void)
+{
+	if (vpw_idx_build(&pwd_idx, vpw_pwfile(), vpw_pwkeyid))
+		vpw_idx_save(&pwd_idx, vpw_pwfile());
+}
+
+static char *
+vpw_pwremake(const struct vpwrec *rec, bool canon)
+{
+	struct passwd *pw;
+	char *line;
+
+	pw = vpw_build(rec);
+	line = NULL;
+	if (!canon && (line = pw_make(pw)) == NULL)
+		err(EXIT_FAILURE, "pw_make()");
+	free(pw);
+	return (line);
+}
+
+/*
+ * Print every user as usershow -a does, for the most part without
+ * making them again.  Returns false if the file cannot be read.
+ */
+bool
+vdumppwent(int fd)
+{
+	struct vpwfile vf;
+
+	if (!vpw_open(&vf, vpw_pwfile(), NULL))
+		return (false);
+	/* name:passwd:uid:gid:class:change:expire:gecos:dir:shell */
+	vpw_dump(&vf, fd, 10, 1U << 2 | 1U << 3 | 1U << 5 | 1U << 6, false,
+	    vpw_pwremake);
+	vpw_close(&vf);
+	return (true);
+}
+
 struct passwd *
 vgetpwuid(uid_t uid)
 {
-  return vnextpwent(NULL, uid, 1);
+  return vlookuppw(NULL, uid);
 }
 
 struct passwd *
 vgetpwnam(const char * nam)
 {
-  return vnextpwent(nam, -1, 1);
+  return vlookuppw(nam, -1);
 }
 
 
-static FILE * grp_fp = NULL;
+static struct vpwfile grp_vf;
+static struct vpwidx grp_idx;
 
 void
 vendgrent(void)
 {
-	if (grp_fp != NULL) {
-		fclose(grp_fp);
-		grp_fp = NULL;
-	}
+	vpw_close(&grp_vf);
 }
 
 void
@@ -148,44 +872,65 @@ vsetgrent(void)
 }
 
 static struct group *
-vnextgrent(char const *nam, gid_t gid, int doclose)
+vgr_build(const struct vpwrec *rec)
 {
 	struct group *gr;
 	char *line;
-	size_t linecap;
-	ssize_t linelen;
+
+	line = vpw_cstr(rec);
+	gr = gr_scan(line);
+	if (gr == NULL)
+		errx(EXIT_FAILURE, "Invalid group entry in '%s':"
+		    " '%s'", getgrpath(_GROUP), line);
+	return (gr);
+}
+
+static bool
+vgr_keyid(const struct vpwrec *rec, uintmax_t *id)
+{
+	struct group *gr;
+
+	if (vpw_keyid(rec, id))
+		return (true);
+	gr = vgr_build(rec);
+	*id = gr->gr_gid;
+	free(gr);
+	return (true);
+}
+
+static struct group *
+vnextgrent(char const *nam, gid_t gid, int doclose)
+{
+	struct group *gr;
+	struct vpwrec rec;
+	uintmax_t id;
 
 	gr = NULL;
-	line = NULL;
-	linecap = 0;
 
-	if (grp_fp != NULL || (grp_fp = fopen(getgrpath(_GROUP), "r")) != NULL) {
-		while ((linelen = getline(&line, &linecap, grp_fp)) > 0) {
-			/* Skip comments and empty lines */
-			if (*line == '\n' || *line == '#')
-				continue;
-			/* trim latest \n */
-			if (line[linelen - 1 ] == '\n')
-				line[linelen - 1] = '\0';
-			gr = gr_scan(line);
-			if (gr == NULL)
-				errx(EXIT_FAILURE, "Invalid group entry in '%s':"
-				    " '%s'", getgrpath(_GROUP), line);
+	if (grp_vf.open || vpw_open(&grp_vf, getgrpath(_GROUP), NULL)) {
+		while (vpw_nextrec(&grp_vf, &rec)) {
 			if (gid != (gid_t)-1) {
-				if (gid == gr->gr_gid)
-					break;
+				if (vpw_keyid(&rec, &id)) {
+					if ((gid_t)id != gid)
+						continue;
+				} else {
+					gr = vgr_build(&rec);
+					if (gr->gr_gid == gid)
+						break;
+					free(gr);
+					gr = NULL;
+					continue;
+				}
 			} else if (nam != NULL) {
-				if (strcmp(nam, gr->gr_name) == 0)
-					break;
-			} else
-				break;
-			free(gr);
-			gr = NULL;
+				if (!vpw_keyeq(&rec, nam))
+					continue;
+			}
+			gr = vgr_build(&rec);
+			break;
 		}
 		if (doclose)
 			vendgrent();
 	}
-	free(line);
 
 	return (gr);
 }
@@ -197,15 +942,65 @@ vgetgrent(void)
 }
 
 
+static struct group *
+vlookupgr(char const *nam, gid_t gid)
+{
+	struct vpwrec rec;
+	bool found;
+
+	if (!vpw_idx_get(&grp_idx, getgrpath(_GROUP), vgr_keyid, nam, gid,
+	    &rec, &found))
+		return (vnextgrent(nam, gid, 1));
+	return (found ? vgr_build(&rec) : NULL);
+}
+
+void
+vgridxupdate(void)
+{
+	if (vpw_idx_build(&grp_idx, getgrpath(_GROUP), vgr_keyid))
+		vpw_idx_save(&grp_idx, getgrpath(_GROUP));
+}
+
+static char *
+vgr_remake(const struct vpwrec *rec, bool canon)
+{
+	struct group *gr;
+	char *line;
+
+	gr = vgr_build(rec);
+	line = NULL;
+	if (!canon && (line = gr_make(gr)) == NULL)
+		err(EXIT_FAILURE, "gr_make()");
+	free(gr);
+	return (line);
+}
+
+/*
+ * Print every group as groupshow -a does, for the most part without
+ * making them again.  Returns false if the file cannot be read.
+ */
+bool
+vdumpgrent(int fd)
+{
+	struct vpwfile vf;
+
+	if (!vpw_open(&vf, getgrpath(_GROUP), NULL))
+		return (false);
+	/* name:passwd:gid:members */
+	vpw_dump(&vf, fd, 4, 1U << 2, true, vgr_remake);
+	vpw_close(&vf);
+	return (true);
+}
+
 struct group *
 vgetgrgid(gid_t gid)
 {
-  return vnextgrent(NULL, gid, 1);
+  return vlookupgr(NULL, gid);
 }
 
 struct group *
 vgetgrnam(const char * nam)
 {
-  return vnextgrent(nam, -1, 1);
+  return vlookupgr(nam, -1);
 }
 
@@ -26,18 +26,22 @@
  * SUCH DAMAGE.
  */
 
-#include <sys/wait.h>
+#include <sys/file.h>
 
 #include <err.h>
 #include <errno.h>
+#include <limits.h>
 #include <pwd.h>
 #include <libutil.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "pwupd.h"
+#include "idstate.h"
 
 char *
 getpwpath(char const * file)
@@ -49,120 +53,227 @@ getpwpath(char const * file)
 	return (pathbuf);
 }
 
-static struct passwd *
-pw_lookup_master(const char *name)
+static void
+lockalarm(int sig)
 {
-	FILE *fp;
-	char *line = NULL;
-	size_t linecap = 0;
-	ssize_t linelen;
-	struct passwd *pw = NULL;
-
-	if (name == NULL)
-		return (NULL);
-	fp = fopen(getpwpath(_MASTERPASSWD), "r");
-	if (fp == NULL)
-		return (NULL);
-
-	while ((linelen = getline(&line, &linecap, fp)) > 0) {
-		if (line[0] == '\n' || line[0] == '#')
-			continue;
-		if (line[linelen - 1] == '\n')
-			line[linelen - 1] = '\0';
-		pw = pw_scan(line, PWSCAN_MASTER);
-		if (pw == NULL)
-			continue;
-		if (strcmp(pw->pw_name, name) == 0)
-			break;
-		free(pw);
-		pw = NULL;
-	}
-
-	free(line);
-	fclose(fp);
-	return (pw);
 }
 
-static int
-pwdb_check(void)
+/* The lock pw_lockwait() holds, until pw_unlockwait() */
+static int waitfd = -1;
+
+/*
+ * Lock path as pw_lock() and gr_lock() do, but with -W wait for up to
+ * conf.lockwait seconds for whoever holds it, blocked in flock() rather
+ * than retrying.  Reports how long it waited.
+ */
+int
+pw_lockwait(const char *path)
 {
-	int             i = 0;
-	pid_t           pid;
-	char           *args[10];
-
-	args[i++] = _PATH_PWD_MKDB;
-#ifdef __APPLE__
-	args[i++] = "-c";
-#else
-	args[i++] = "-C";
-#endif
-
-	if (strcmp(conf.etcpath, _PATH_PWD) != 0) {
-		args[i++] = "-d";
-		args[i++] = conf.etcpath;
+	struct sigaction sa, osa;
+	struct timespec	 start, now;
+	struct stat	 st;
+	time_t		 left;
+	bool		 waited;
+	int		 fd, rc;
+
+	waited = false;
+	for (;;) {
+		if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+			err(1, "%s", path);
+		if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+			if (errno != EWOULDBLOCK)
+				err(1, "%s", path);
+			if (!waited) {
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				waited = true;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if ((left = conf.lockwait - (now.tv_sec -
+			    start.tv_sec)) <= 0)
+				errx(1, "%s: still busy after %d seconds", path,
+				    conf.lockwait);
+			memset(&sa, 0, sizeof(sa));
+			sa.sa_handler = lockalarm;
+			sigemptyset(&sa.sa_mask);
+			sigaction(SIGALRM, &sa, &osa);
+			alarm(left);
+			rc = flock(fd, LOCK_EX);
+			alarm(0);
+			sigaction(SIGALRM, &osa, NULL);
+			if (rc == -1) {
+				if (errno != EINTR)
+					err(1, "%s", path);
+				close(fd);
+				continue;	/* time is up, or a stray signal */
+			}
+		}
+		if (fstat(fd, &st) == -1)
+			err(1, "%s", path);
+		if (st.st_nlink != 0)
+			break;
+		close(fd);			/* replaced while we waited */
 	}
-	args[i++] = getpwpath(_MASTERPASSWD);
-	args[i] = NULL;
-
-	if ((pid = fork()) == -1)	/* Error (errno set) */
-		i = errno;
-	else if (pid == 0) {	/* Child */
-		execv(args[0], args);
-		_exit(1);
-	} else {		/* Parent */
-		waitpid(pid, &i, 0);
-		if (WEXITSTATUS(i))
-			i = EIO;
+	if (waited) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		warnx("waited %.1f seconds for %s", now.tv_sec - start.tv_sec +
+		    (now.tv_nsec - start.tv_nsec) / 1e9, path);
 	}
+	return (waitfd = fd);
+}
 
-	return (i);
+/*
+ * Release the lock pw_lockwait() took, if it still holds one.  Safe to
+ * call at any time, so that one left behind by err(3) can be dropped.
+ */
+void
+pw_unlockwait(void)
+{
+	if (waitfd != -1)
+		close(waitfd);
+	waitfd = -1;
 }
 
-static int
-pw_update(struct passwd * pwd, char const * user)
+/*
+ * The generation of master.passwd last found valid, so that an
+ * unchanged file is not checked again
+ */
+static struct stat pwchecked;
+static bool pwcheckedok;
+
+static bool
+pw_samefile(const struct stat *a, const struct stat *b)
 {
-	struct passwd	*pw = NULL;
-	struct passwd	*old_pw = NULL;
-	int		 rc, pfd, tfd;
 
-	if ((rc = pwdb_check()) != 0)
-		return (rc);
+	return (a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+	    a->st_size == b->st_size &&
+	    a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+	    a->st_mtim.tv_nsec == b->st_mtim.tv_nsec);
+}
 
-	if (pwd != NULL)
-		pw = pw_dup(pwd);
+/*
+ * The checks pwd_mkdb -C makes of each line of master.passwd: lines
+ * must fit its buffer, and all but blank lines and comments must
+ * parse as records.
+ */
+static bool
+pwdb_checkline(const char *line, size_t len, unsigned long lineno)
+{
+	struct passwd	*pw;
+	const char	*p;
+	char		*buf;
 
-	if (user != NULL)
-		old_pw = pw_lookup_master(user);
+	if (len > 0 && line[len - 1] == '\n')
+		len--;
+	if (len >= LINE_MAX - 1) {
+		warnx("line #%lu too long", lineno);
+		goto fmt;
+	}
+	for (p = line; p < line + len; p++)
+		if (*p != ' ' && *p != '\t')
+			break;
+	if (p == line + len || *p == '#')
+		return (true);
+	if ((buf = strndup(line, len)) == NULL)
+		err(1, "strndup()");
+	pw = pw_scan(buf, PWSCAN_WARN | PWSCAN_MASTER);
+	free(buf);
+	if (pw == NULL) {
+		warnx("at line #%lu", lineno);
+fmt:		warnx("%s: %s", getpwpath(_MASTERPASSWD), strerror(EFTYPE));
+		return (false);
+	}
+	free(pw);
+	return (true);
+}
+
+/*
+ * Apply a set of pending changes to master.passwd in one pass: records
+ * named by a change are replaced or dropped where they stand, new ones
+ * are appended, and everything else is copied through unchanged.
+ * Returns -1 with errno set on failure, leaving the file untouched.
+ */
+int
+pw_commit(struct pwtxent *ent, size_t n)
+{
+	struct pwtxent	*e;
+	struct passwd	*pw;
+	struct stat	 st;
+	size_t		 i, nids, nrec;
+	uintmax_t	*ids;
+	bool		 freed, check;
+	int		 rc, pfd, tfd;
 
 	if (pw_init(conf.etcpath, NULL))
 		err(1, "pw_init()");
-	if ((pfd = pw_lock()) == -1) {
+	if (conf.lockwait > 0)
+		pfd = pw_lockwait(getpwpath(_MASTERPASSWD));
+	else if ((pfd = pw_lock()) == -1) {
 		pw_fini();
 		err(1, "pw_lock()");
 	}
+	if (fstat(pfd, &st) == -1) {
+		pw_fini();
+		err(1, "fstat()");
+	}
 	if ((tfd = pw_tmp(-1)) == -1) {
 		pw_fini();
 		err(1, "pw_tmp()");
 	}
-	if (pw_copy(pfd, tfd, pw, old_pw) == -1) {
-		pw_fini();
+
+	/*
+	 * Check the file as we copy it, unless it is as we last left it
+	 */
+	check = !pwcheckedok || !pw_samefile(&st, &pwchecked);
+	if ((rc = pw_txrewrite(PWTX_PW, pfd, tfd, ent, n,
+	    check ? pwdb_checkline : NULL)) != 0) {
 		close(tfd);
-		err(1, "pw_copy()");
+		pw_fini();
+		pw_unlockwait();
+		errno = rc;
+		return (-1);
+	}
+	if (pw_txfolding(PWTX_PW, tfd) == -1) {
+		pw_fini();
+		err(1, "%s", getpwpath(_PWJOURNAL));
 	}
-	fsync(tfd);
 	close(tfd);
+
+	if ((ids = calloc(n ? n : 1, sizeof(*ids))) == NULL)
+		err(1, "calloc()");
+	nids = nrec = 0;
+	freed = false;
+	pw = NULL;
+	for (i = 0; i < n; i++) {
+		e = &ent[i];
+		if (e->key == NULL && e->rec == NULL)
+			continue;
+		nrec++;
+		if (e->rec == NULL) {
+			freed = true;
+			continue;
+		}
+		pw = e->rec;
+		if (e->key != NULL && e->oid != pw->pw_uid)
+			freed = true;
+		ids[nids++] = pw->pw_uid;
+	}
+
 	/*
-	 * in case of deletion of a user, the whole database
-	 * needs to be regenerated
+	 * A lone addition or change can be applied to the hashed
+	 * databases by itself; anything else needs them regenerated.
 	 */
-	if (pw_mkdb(pw != NULL ? pw->pw_name : NULL) == -1) {
+	if (pw_mkdb(nrec == 1 && pw != NULL ? pw->pw_name : NULL) == -1) {
 		pw_fini();
 		err(1, "pw_mkdb()");
 	}
-	free(old_pw);
-	free(pw);
+	/* pwd_mkdb has just parsed every line of it */
+	pwcheckedok = stat(getpwpath(_MASTERPASSWD), &pwchecked) == 0;
+	if (PWALTDIR() != PWF_REGULAR)
+		vpwidxupdate();
+	ids_commit(IDS_UID, &st, ids, nids, freed);
 	pw_fini();
-
+	pw_unlockwait();
+	free(ids);
 	return (0);
 }
 
@@ -170,19 +281,19 @@ int
 addpwent(struct passwd * pwd)
 {
 
-	return (pw_update(pwd, NULL));
+	return (pw_txadd(PWTX_PW, pwd));
 }
 
 int
 chgpwent(char const * login, struct passwd * pwd)
 {
 
-	return (pw_update(pwd, login));
+	return (pw_txchg(PWTX_PW, login, pwd));
 }
 
 int
 delpwent(struct passwd * pwd)
 {
 
-	return (pw_update(NULL, pwd->pw_name));
+	return (pw_txdel(PWTX_PW, pwd->pw_name));
 }
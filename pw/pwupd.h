@@ -35,6 +35,7 @@
 #include <pwd.h>
 #include <grp.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stringlist.h>
 
 struct pwf {
@@ -55,6 +56,7 @@ struct userconf {
 	int		default_password;	/* Default password for new users? */
 	int		reuse_uids;		/* Reuse uids? */
 	int		reuse_gids;		/* Reuse gids? */
+	int		idstate;		/* Keep id allocator state? */
 	char		*nispasswd;		/* Path to NIS version of the passwd file */
 	char		*dotdir;		/* Where to obtain skeleton files */
 	char		*newmail;		/* Mail to send to new accounts */
@@ -81,6 +83,8 @@ struct pwconf {
 	int		 rootfd;
 	bool		 altroot;
 	bool		 checkduplicate;
+	bool		 journal;		/* commit to pw.journal */
+	int		 lockwait;		/* seconds to wait for locks */
 };
 
 extern struct pwf PWF;
@@ -104,6 +108,22 @@ extern struct pwconf conf;
 #define PWF_ROOTDIR 2
 
 #define PWALTDIR()	PWF._altdir
+
+/*
+ * A pending change to one record of master.passwd or group.  key is the
+ * name the record has in the file (NULL for a new record), oid its id
+ * there, and rec the record to write in its place (NULL to delete it).
+ * An entry with neither is unused.
+ */
+struct pwtxent {
+	char		*key;
+	uintmax_t	 oid;
+	void		*rec;
+};
+
+#define PWTX_PW		0
+#define PWTX_GR		1
+#define PWTX_NIS	2		/* a NIS passwd file */
 #ifndef _PATH_PWD
 #define _PATH_PWD	"/etc"
 #endif
@@ -113,8 +133,35 @@ extern struct pwconf conf;
 #ifndef _MASTERPASSWD
 #define _MASTERPASSWD	"master.passwd"
 #endif
+#define _PWJOURNAL	"pw.journal"
+#define _PWSOCKET	"pw.socket"
+
+struct bitmap;
 
 __BEGIN_DECLS
+void pw_txbegin(void);
+int pw_txcommit(void);
+int pw_txend(void);
+int pw_txadd(int kind, void *rec);
+int pw_txchg(int kind, const char *name, void *rec);
+int pw_txdel(int kind, const char *name);
+int pw_txnis(const char *path, const char *name, void *rec);
+bool pw_txclean(int kind);
+size_t pw_txsave(void);
+void pw_txrollback(size_t mark);
+bool pw_txidget(int kind, uintmax_t min, uintmax_t max, struct bitmap *bm);
+void pw_txidput(int kind, uintmax_t min, uintmax_t max, struct bitmap *bm);
+
+int pw_lockwait(const char *path);
+void pw_unlockwait(void);
+int pw_txfolding(int kind, int tfd);
+int pw_txrewrite(int kind, int ifd, int ofd, struct pwtxent *ent, size_t n,
+    bool (*check)(const char *, size_t, unsigned long));
+int pw_commit(struct pwtxent *ent, size_t n);
+int gr_commit(struct pwtxent *ent, size_t n);
+int gr_restore(int ofd);
+int nis_commit(const char *path, struct pwtxent *ent, size_t n);
+
 int addpwent(struct passwd * pwd);
 int delpwent(struct passwd * pwd);
 int chgpwent(char const * login, struct passwd * pwd);
@@ -124,6 +171,8 @@ char * getpwpath(char const * file);
 int addgrent(struct group * grp);
 int delgrent(struct group * grp);
 int chggrent(char const * name, struct group * grp);
+void chggrmembers(const char *name, const char *newname,
+    StringList *groups, bool replace);
 
 char * getgrpath(const char *file);
 
@@ -132,12 +181,16 @@ void vendpwent(void);
 struct passwd * vgetpwent(void);
 struct passwd * vgetpwuid(uid_t uid);
 struct passwd * vgetpwnam(const char * nam);
+void vpwidxupdate(void);
+bool vdumppwent(int fd);
 
 struct group * vgetgrent(void);
 struct group * vgetgrgid(gid_t gid);
 struct group * vgetgrnam(const char * nam);
 void           vsetgrent(void);
 void           vendgrent(void);
+void           vgridxupdate(void);
+bool           vdumpgrent(int fd);
 
 void copymkdir(int rootfd, char const * dir, int skelfd, mode_t mode, uid_t uid,
     gid_t gid, int flags);
@@ -1,3 +1,4 @@
 PW_SRCS=	pw.c pw_conf.c pw_user.c pw_group.c pw_log.c pw_nis.c pw_vpw.c \
 		grupd.c pwupd.c psdate.c bitmap.c cpdir.c rm_r.c strtounum.c \
-		pw_utils.c strtonum.c chflagsat.c
+		pw_utils.c strtonum.c chflagsat.c idstate.c \
+		pw_txn.c pw_serve.c pw_out.c pw_query.c